@@ -0,0 +1,73 @@
+/*
+  Copyright (c) 2021 Peter Hsu.  All Rights Reserved.  See LICENCE file for details.
+*/
+
+#include <unistd.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "barrier.h"
+
+#define futex(a, b, c)  syscall(SYS_futex, a, b, c, 0, 0, 0)
+
+#define ONE_ACTIVE  (1L<<32)
+#define ACTIVE(s)   ((s) >> 32)
+#define ARRIVED(s)  ((s) & 0xffffffffL)
+
+barrier_t::barrier_t(long q)
+{
+  quantum = q;
+  _time = q;
+  state = 0;
+  phase = 0;
+}
+
+void barrier_t::advance(bool wake)
+{
+  _time += quantum;
+  __sync_fetch_and_add(&phase, 1);
+  if (wake)
+    futex(&phase, FUTEX_WAKE, INT_MAX);
+}
+
+void barrier_t::join()
+{
+  __sync_fetch_and_add(&state, ONE_ACTIVE);
+}
+
+void barrier_t::leave()
+{
+  long s, n;
+  bool last;
+  do {
+    s = state;
+    n = s - ONE_ACTIVE;
+    last = ACTIVE(n) > 0 && ARRIVED(n) == ACTIVE(n);
+    if (last)			// everyone else was waiting for us
+      n = ACTIVE(n) << 32;
+  } while (!__sync_bool_compare_and_swap(&state, s, n));
+  if (last)
+    advance(true);
+}
+
+void barrier_t::wait()
+{
+  int p = phase;		// cannot advance until we arrive
+  long s, n;
+  bool last;
+  do {
+    s = state;
+    n = s + 1;
+    last = ARRIVED(n) == ACTIVE(n);
+    if (last)
+      n = ACTIVE(n) << 32;
+  } while (!__sync_bool_compare_and_swap(&state, s, n));
+  if (last) {
+    advance(ACTIVE(n) > 1);
+    return;
+  }
+  for (long spin=0; phase == p; spin++)
+    if (spin > BARRIER_SPIN)
+      futex(&phase, FUTEX_WAIT, p);
+}
@@ -0,0 +1,32 @@
+/*
+  Copyright (c) 2021 Peter Hsu.  All Rights Reserved.  See LICENCE file for details.
+*/
+
+#ifndef BARRIER_H
+#define BARRIER_H
+
+// Conservative time synchronization.  Simulated time is divided into
+// quanta; a core reaching the end of the current quantum waits until
+// every participating core has done the same, so no two cores are more
+// than one quantum apart.  Cores leave while blocked in a system call
+// (e.g. guest futex) and join again afterward, hence the participant
+// count and arrival count share one word updated by compare-and-swap.
+
+#define BARRIER_SPIN  1000	// polls before sleeping in futex
+
+class barrier_t {
+  volatile long state;		// active<<32 | arrived
+  volatile int phase;		// futex word, incremented each quantum
+  volatile long _time;		// end of current quantum
+  long quantum;
+  void advance(bool wake);
+public:
+  barrier_t(long q);
+  long time() { return _time; }	// cores may run until this cycle
+  long start() { return _time - quantum; }
+  void join();
+  void leave();
+  void wait();			// at end of quantum
+};
+
+#endif
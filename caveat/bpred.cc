@@ -0,0 +1,207 @@
+/*
+  Copyright (c) 2021 Peter Hsu.  All Rights Reserved.  See LICENCE file for details.
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "options.h"
+#include "uspike.h"
+#include "instructions.h"
+#include "bpred.h"
+
+#define J_NONE      0
+#define J_COND      1		// already seen by branch()
+#define J_DIRECT    2		// jal, c.j, c.jal
+#define J_INDIRECT  3		// jalr, c.jr, c.jalr
+
+static char jump_kind[Op_UNKNOWN+1];
+
+static const int tage_hist[TAGE_TABLES] = { 5, 12, 27, 60 };
+
+static void init_jump_kind()
+{
+  static const char* cond[] = { "beq", "bne", "blt", "bge", "bltu", "bgeu", "c_beqz", "c_bnez", 0 };
+  static const char* direct[] = { "jal", "c_j", "c_jal", 0 };
+  static const char* indirect[] = { "jalr", "c_jr", "c_jalr", 0 };
+  for (int op=0; op<=Op_UNKNOWN; op++) {
+    const char* n = op_name[op];
+    if (!n)
+      continue;
+    for (int k=0; cond[k]; k++)
+      if (strcmp(n, cond[k]) == 0)
+	jump_kind[op] = J_COND;
+    if (strncmp(n, "cas", 3) == 0) // fused compare-and-swap loop
+      jump_kind[op] = J_COND;
+    for (int k=0; direct[k]; k++)
+      if (strcmp(n, direct[k]) == 0)
+	jump_kind[op] = J_DIRECT;
+    for (int k=0; indirect[k]; k++)
+      if (strcmp(n, indirect[k]) == 0)
+	jump_kind[op] = J_INDIRECT;
+  }
+}
+
+bpred_t::bpred_t(const char* name, int lg_size, int lg_btb, int ras_entries)
+{
+  if      (strcmp(name, "bimodal") == 0)  kind = BP_BIMODAL;
+  else if (strcmp(name, "gshare")  == 0)  kind = BP_GSHARE;
+  else if (strcmp(name, "tage")    == 0)  kind = BP_TAGE;
+  else
+    quitif(1, "branch predictor %s not bimodal, gshare or tage", name);
+  static bool initialized = false;
+  if (!initialized) {
+    init_jump_kind();
+    initialized = true;
+  }
+  pht_mask = (1L<<lg_size) - 1;
+  pht = new uint8_t[1L<<lg_size];
+  memset(pht, 1, 1L<<lg_size);	// weakly not taken
+  tage_lg = lg_size - 2;
+  for (int t=0; t<TAGE_TABLES; t++) {
+    tage[t] = 0;
+    if (kind == BP_TAGE) {
+      tage[t] = new tage_entry_t[1L<<tage_lg];
+      for (long k=0; k<(1L<<tage_lg); k++)
+	tage[t][k] = (tage_entry_t){ 0xFFFF, 0, 0 }; // tag never matches
+    }
+  }
+  history = 0;
+  btb_mask = (1L<<lg_btb) - 1;
+  btb = new btb_entry_t[1L<<lg_btb];
+  memset(btb, 0, (1L<<lg_btb)*sizeof(btb_entry_t));
+  ras_size = ras_entries > 0 ? ras_entries : 1;
+  ras = new long[ras_size];
+  memset(ras, 0, ras_size*sizeof(long));
+  ras_top = 0;
+  last_miss = false;
+  _branches = _mispredicts = 0;
+  _jumps = _redirects = _jmispredicts = 0;
+}
+
+static inline long fold(uint64_t h, int bits)
+{
+  long x = 0;
+  for (; h; h >>= bits)
+    x ^= h & ((1L<<bits)-1);
+  return x;
+}
+
+// TAGE-lite: bimodal base plus tagged tables with geometric history
+// lengths.  The longest matching table provides the prediction; a
+// misprediction allocates an entry in a longer table.
+
+bool bpred_t::tage_branch(bool taken, long pc)
+{
+  long idx[TAGE_TABLES];
+  uint16_t tag[TAGE_TABLES];
+  int provider = -1, alt = -1;
+  for (int t=0; t<TAGE_TABLES; t++) {
+    uint64_t h = history & ((1UL<<tage_hist[t])-1);
+    idx[t] = ((pc>>1) ^ (pc>>(tage_lg+1)) ^ fold(h, tage_lg)) & ((1L<<tage_lg)-1);
+    tag[t] = ((pc>>1) ^ fold(h, TAGE_TAGBITS) ^ (fold(h, TAGE_TAGBITS-1)<<1)) & ((1<<TAGE_TAGBITS)-1);
+    if (tage[t][idx[t]].tag == tag[t]) {
+      alt = provider;
+      provider = t;
+    }
+  }
+  uint8_t* base = &pht[(pc>>1) & pht_mask];
+  bool altpred = alt >= 0 ? tage[alt][idx[alt]].ctr >= 0 : *base >= 2;
+  bool pred = provider >= 0 ? tage[provider][idx[provider]].ctr >= 0 : altpred;
+  if (provider >= 0) {
+    tage_entry_t* e = &tage[provider][idx[provider]];
+    if (taken)
+      e->ctr += (e->ctr < 3);
+    else
+      e->ctr -= (e->ctr > -4);
+    if (pred != altpred) {
+      if (pred == taken)
+	e->u += (e->u < 3);
+      else
+	e->u -= (e->u > 0);
+    }
+  }
+  else if (taken)
+    *base += (*base < 3);
+  else
+    *base -= (*base > 0);
+  if (pred != taken && provider < TAGE_TABLES-1) {
+    bool allocated = false;
+    for (int t=provider+1; t<TAGE_TABLES && !allocated; t++) {
+      tage_entry_t* e = &tage[t][idx[t]];
+      if (e->u == 0) {
+	e->tag = tag[t];
+	e->ctr = taken ? 0 : -1;
+	allocated = true;
+      }
+    }
+    if (!allocated)
+      for (int t=provider+1; t<TAGE_TABLES; t++)
+	tage[t][idx[t]].u -= (tage[t][idx[t]].u > 0);
+  }
+  if ((_branches & (TAGE_RESET-1)) == 0)
+    for (int t=0; t<TAGE_TABLES; t++)
+      for (long k=0; k<(1L<<tage_lg); k++)
+	tage[t][k].u >>= 1;
+  return pred != taken;
+}
+
+int bpred_t::jump(long npc, long pc)
+{
+  _jumps++;
+  Insn_t i = code.at(pc);
+  int len = i.compressed() ? 2 : 4;
+  bool link_rd  = i.rd()  == 1 || i.rd()  == 5;
+  bool link_rs1 = i.rs1() == 1 || i.rs1() == 5;
+  int result = JUMP_OK;
+  switch (jump_kind[i.opcode()]) {
+  case J_COND:
+    if (last_miss)		// already charged by branch()
+      return JUMP_OK;
+    if (!btb_hit(pc, npc))
+      result = JUMP_REDIRECT;
+    break;
+  case J_DIRECT:
+    if (link_rd)
+      push(pc+len);
+    if (!btb_hit(pc, npc))
+      result = JUMP_REDIRECT;
+    break;
+  case J_INDIRECT:
+    {
+      bool ret = link_rs1 && !(link_rd && i.rd() == i.rs1());
+      long predicted;
+      if (ret)
+	predicted = pop();
+      else {
+	btb_entry_t* b = &btb[(pc>>1) & btb_mask];
+	predicted = b->pc == pc ? b->target : 0;
+	b->pc = pc;
+	b->target = npc;
+      }
+      if (link_rd)
+	push(pc+len);
+      if (predicted != npc)
+	result = JUMP_MISPREDICT;
+    }
+    break;
+  default:
+    result = JUMP_REDIRECT;	// unknown, treat as BTB miss
+  }
+  _redirects += (result == JUMP_REDIRECT);
+  _jmispredicts += (result == JUMP_MISPREDICT);
+  return result;
+}
+
+void bpred_t::print(FILE* f)
+{
+  static const char* kind_name[] = { "bimodal", "gshare", "TAGE" };
+  fprintf(f, "Branch prediction (%s)\n", kind_name[kind]);
+  fprintf(f, "  %ld conditional branches\n", _branches);
+  fprintf(f, "  %ld mispredicted (%5.3f%%)\n", _mispredicts, 100.0*_mispredicts/_branches);
+  fprintf(f, "  %ld taken transfers\n", _jumps);
+  fprintf(f, "  %ld BTB misses (%5.3f%%)\n", _redirects, 100.0*_redirects/_jumps);
+  fprintf(f, "  %ld wrong targets (%5.3f%%)\n", _jmispredicts, 100.0*_jmispredicts/_jumps);
+}
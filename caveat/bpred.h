@@ -0,0 +1,95 @@
+/*
+  Copyright (c) 2021 Peter Hsu.  All Rights Reserved.  See LICENCE file for details.
+*/
+
+#ifndef BPRED_H
+#define BPRED_H
+
+// Branch prediction, one instance per core.  A direction predictor
+// (bimodal, gshare or a small TAGE) sees every conditional branch;
+// taken transfers also consult a direct-mapped branch target buffer,
+// and calls and returns a return address stack.  Counters are bytes
+// and TAGE entries 4 bytes, so default tables fit in a few KB.
+
+#define BP_BIMODAL  0
+#define BP_GSHARE   1
+#define BP_TAGE     2
+
+#define JUMP_OK          0	// target predicted
+#define JUMP_REDIRECT    1	// BTB miss, target known at decode
+#define JUMP_MISPREDICT  2	// wrong target
+
+#define TAGE_TABLES   4
+#define TAGE_TAGBITS  10
+#define TAGE_RESET    (1L<<18)	// branches between usefulness aging
+
+struct tage_entry_t {
+  uint16_t tag;
+  int8_t ctr;			// 3-bit signed, taken if >= 0
+  uint8_t u;			// 2-bit usefulness
+};
+
+struct btb_entry_t {
+  long pc;
+  long target;
+};
+
+class bpred_t {
+  int kind;
+  long pht_mask;
+  uint8_t* pht;			// 2-bit counters, also TAGE base predictor
+  tage_entry_t* tage[TAGE_TABLES];
+  long tage_lg;			// log-base-2 entries per tagged table
+  uint64_t history;		// global, most recent outcome in bit 0
+  btb_entry_t* btb;
+  long btb_mask;
+  long* ras;
+  long ras_top, ras_size;
+  bool last_miss;		// last conditional branch mispredicted
+  long _branches, _mispredicts;
+  long _jumps, _redirects, _jmispredicts;
+
+  bool tage_branch(bool taken, long pc);
+  bool btb_hit(long pc, long npc);
+  void push(long a) { ras_top = (ras_top+1) % ras_size; ras[ras_top] = a; }
+  long pop() { long a = ras[ras_top]; ras_top = (ras_top+ras_size-1) % ras_size; return a; }
+public:
+  bpred_t(const char* name, int lg_size, int lg_btb, int ras_entries);
+  bool branch(bool taken, long pc);	// true if mispredicted
+  int jump(long npc, long pc);		// JUMP_ code
+  void print(FILE* f =stderr);
+};
+
+inline bool bpred_t::branch(bool taken, long pc)
+{
+  _branches++;
+  bool miss;
+  if (kind == BP_TAGE)
+    miss = tage_branch(taken, pc);
+  else {
+    long k = pc >> 1;
+    if (kind == BP_GSHARE)
+      k ^= history;
+    uint8_t* c = &pht[k & pht_mask];
+    miss = (*c >= 2) != taken;
+    if (taken)
+      *c += (*c < 3);
+    else
+      *c -= (*c > 0);
+  }
+  history = history<<1 | taken;
+  _mispredicts += miss;
+  last_miss = miss;
+  return miss;
+}
+
+inline bool bpred_t::btb_hit(long pc, long npc)
+{
+  btb_entry_t* b = &btb[(pc>>1) & btb_mask];
+  bool hit = b->pc == pc && b->target == npc;
+  b->pc = pc;
+  b->target = npc;
+  return hit;
+}
+
+#endif
@@ -10,20 +10,42 @@
 #include "lru_fsm_3way.h"
 #include "lru_fsm_4way.h"
 
-cache_t::cache_t(const char* nam, int miss, int w, int lin, int row, bool writeable)
+cache_t::cache_t(const char* nam, int miss, int w, int lin, int row, bool writeable, const char* repl)
 {
   name = nam;
   _penalty = miss;
   ways = w;
-  switch (ways) {
-  case 1:  fsm = cache_fsm_1way;  break;
-  case 2:  fsm = cache_fsm_2way;  break;
-  case 3:  fsm = cache_fsm_3way;  break;
-  case 4:  fsm = cache_fsm_4way;  break;
-  default:
-    fprintf(stderr, "ways=%ld only 1..4 ways implemented\n", ways);
+  if (ways < 1 || ways > MAX_WAYS) {
+    fprintf(stderr, "ways=%ld only 1..%d ways implemented\n", ways, MAX_WAYS);
+    syscall(SYS_exit_group, -1);
+  }
+  for (lg_ways=0; (1L<<lg_ways) < ways; lg_ways++)
+    ;
+  fsm = 0;
+  if (strcmp(repl, "lru") == 0) {
+    policy = REPL_LRU;
+    switch (ways) {
+    case 1:  fsm = cache_fsm_1way;  break;
+    case 2:  fsm = cache_fsm_2way;  break;
+    case 3:  fsm = cache_fsm_3way;  break;
+    case 4:  fsm = cache_fsm_4way;  break;
+    } /* note fsm purposely point to [-1] */
+    if (fsm)
+      policy = REPL_FSM;
+  }
+  else if (strcmp(repl, "plru") == 0) {
+    policy = REPL_PLRU;
+    if (ways != 1L<<lg_ways) {
+      fprintf(stderr, "ways=%ld plru needs power of 2 ways\n", ways);
+      syscall(SYS_exit_group, -1);
+    }
+  }
+  else if (strcmp(repl, "rrip") == 0)
+    policy = REPL_RRIP;
+  else {
+    fprintf(stderr, "replacement policy %s not lru, plru or rrip\n", repl);
     syscall(SYS_exit_group, -1);
-  } /* note fsm purposely point to [-1] */
+  }
   lg_line = lin;
   lg_rows = row;
   line = 1 << lg_line;
@@ -31,29 +53,133 @@ cache_t::cache_t(const char* nam, int miss, int w, int lin, int row, bool writea
   tag_mask = ~(line-1);
   //  row_mask =  (rows-1) << lg_line;
   row_mask =  (rows-1);
-  tags = new tag_t*[ways];
-  for (int k=0; k<ways; k++)
-    tags[k] = new tag_t[rows];
+  stride = (ways+VEC_WAYS-1) & ~(VEC_WAYS-1);
+  tags = (long*)aligned_alloc(64, (rows*stride*sizeof(long)+63) & ~63L);
+  dirty = new uint64_t[rows];
+  excl = new uint64_t[rows];
+  pref = new uint64_t[rows];
   states = new unsigned short[rows];
+  ages = new uint8_t[rows*stride];
+  plru = new uint64_t[rows];
   flush();
-  static long place =0;
-  evicted = writeable ? &place : 0;
+  this->writeable = writeable;
+  _evicted = _victim = 0;
+  _lastrow = _lastway = 0;
   _refs = _misses = 0;
   _updates = _evictions = 0;
+  _prefetches = _useful = _useless = 0;
+  _lastpref = false;
 }
 
 
 void cache_t::flush()
 {
-  for (int k=0; k<ways; k++)
-    memset((char*)tags[k], 0, rows*sizeof(long));
+  for (long k=0; k<rows*stride; k++)
+    tags[k] = NOTAG;
+  memset((char*)dirty, 0, rows*sizeof(uint64_t));
+  memset((char*)excl, 0, rows*sizeof(uint64_t));
+  memset((char*)pref, 0, rows*sizeof(uint64_t));
   memset((char*)states, 0, rows*sizeof(unsigned short));
+  memset((char*)plru, 0, rows*sizeof(uint64_t));
+  for (long i=0; i<rows; i++) {
+    uint8_t* age = ages + i*stride;
+    for (int k=0; k<stride; k++)
+      age[k] = k >= ways ? 0xFF : policy == REPL_RRIP ? RRIP_MAX : ways-1-k;
+  }
+}
+
+int cache_t::victim(long index)
+{
+  uint8_t* age = ages + index*stride;
+  switch (policy) {
+  case REPL_LRU:
+    for (int k=0; k<ways; k++)
+      if (age[k] == ways-1)
+	return k;
+    break;
+  case REPL_PLRU:
+    {
+      uint64_t bits = plru[index];
+      long node = 1;
+      for (int lvl=0; lvl<lg_ways; lvl++)
+	node = 2*node + (bits >> node & 1);
+      return node - ways;
+    }
+  case REPL_RRIP:
+    for (;;) {
+      for (int k=0; k<ways; k++)
+	if (age[k] == RRIP_MAX)
+	  return k;
+      for (int k=0; k<ways; k++)
+	age[k]++;
+    }
+  default:
+    break;
+  }
+  return 0;
+}
+
+void cache_t::fill(long index, int way)
+{
+  if (policy == REPL_RRIP)
+    ages[index*stride+way] = RRIP_MAX-1;
+  else
+    touch(index, way);
+}
+
+// Prefetch fills go through lookup, so replacement state is updated
+// exactly as for a demand miss, but are not counted as references.
+
+bool cache_t::prefetch(long addr)
+{
+  long refs = _refs, misses = _misses, useful = _useful;
+  bool hit = lookup(addr);
+  if (!hit) {
+    pref[_lastrow] |= 1UL << _lastway;
+    _prefetches++;
+  }
+  else if (_lastpref)		// still not referenced
+    pref[_lastrow] |= 1UL << _lastway;
+  _refs = refs;
+  _misses = misses;
+  _useful = useful;
+  _lastpref = false;
+  return hit;
+}
+
+bool cache_t::invalidate(long addr)
+{
+  addr >>= lg_line;
+  long index = addr & row_mask;
+  long* row = tags + index*stride;
+  int way = find(row, addr);
+  if (way < 0)
+    return false;
+  bool was_dirty = dirty[index] >> way & 1;
+  row[way] = NOTAG;
+  dirty[index] &= ~(1UL << way);
+  excl[index] &= ~(1UL << way);
+  pref[index] &= ~(1UL << way);
+  return was_dirty;
+}
+
+bool cache_t::downgrade(long addr)
+{
+  addr >>= lg_line;
+  long index = addr & row_mask;
+  int way = find(tags + index*stride, addr);
+  if (way < 0)
+    return false;
+  bool was_dirty = dirty[index] >> way & 1;
+  dirty[index] &= ~(1UL << way);
+  excl[index] &= ~(1UL << way);
+  return was_dirty;
 }
 
 void cache_t::show()
 {
-  fprintf(stderr, "lg_line=%ld lg_rows=%ld line=%ld rows=%ld ways=%ld row_mask=0x%lx\n",
-	  lg_line, lg_rows, line, rows, ways, row_mask);
+  fprintf(stderr, "lg_line=%ld lg_rows=%ld line=%ld rows=%ld ways=%ld stride=%ld row_mask=0x%lx\n",
+	  lg_line, lg_rows, line, rows, ways, stride, row_mask);
 }
 
 void cache_t::print(FILE* f)
@@ -65,14 +191,62 @@ void cache_t::print(FILE* f)
   else                         fprintf(f, "  %ld B capacity\n", size);
   fprintf(f, "  %ld bytes line size\n", line);
   fprintf(f, "  %ld ways set associativity\n", ways);
+  static const char* repl_name[] = { "LRU", "LRU", "tree-PLRU", "RRIP" };
+  fprintf(f, "  %s replacement\n", repl_name[policy]);
   fprintf(f, "  %ld cycles miss penalty\n", _penalty);
   fprintf(f, "  %ld references\n", _refs);
   fprintf(f, "  %ld misses (%5.3f%%)\n", _misses, 100.0*_misses/_refs);
-#if 0
-  if (evicted)
+  if (writeable)
     fprintf(f, "  %ld stores (%5.3f%%)\n", _updates, 100.0*_updates/_refs);
-  if (evicted)
+  if (writeable)
     fprintf(f, "  %ld writebacks (%5.3f%%)\n", _evictions, 100.0*_evictions/_refs);
-#endif
+  if (_prefetches) {
+    fprintf(f, "  %ld prefetches\n", _prefetches);
+    fprintf(f, "  %ld useful (%5.3f%%)\n", _useful, 100.0*_useful/_prefetches);
+    fprintf(f, "  %ld polluting (%5.3f%%)\n", _useless, 100.0*_useless/_prefetches);
+  }
+}
+
+
+shared_cache_t::shared_cache_t(const char* nam, int miss, int w, int lin, int row, int lg_bank, const char* repl)
+{
+  name = nam;
+  lg_banks = lg_bank;
+  lg_line = lin;
+  if (lg_banks < 0 || lg_banks > row) {
+    fprintf(stderr, "%s cache banks=2^%ld more than rows=2^%d\n", name, lg_banks, row);
+    syscall(SYS_exit_group, -1);
+  }
+  banks = new bank_t[1L<<lg_banks];
+  for (long k=0; k<(1L<<lg_banks); k++) {
+    banks[k].lock = 0;
+    banks[k].c = new cache_t(name, miss, w, lin, row-lg_banks, true, repl);
+  }
+}
+
+void shared_cache_t::print(FILE* f)
+{
+  long refs=0, misses=0, updates=0, evictions=0;
+  for (long k=0; k<(1L<<lg_banks); k++) {
+    cache_t* c = banks[k].c;
+    refs += c->refs();
+    misses += c->misses();
+    updates += c->updates();
+    evictions += c->evictions();
+  }
+  cache_t* c = banks[0].c;
+  fprintf(f, "%s cache (shared)\n", name);
+  long size = (1L << (c->lg_linesize()+c->lg_numrows()+lg_banks)) * c->associativity();
+  if      (size >= 1024*1024)  fprintf(f, "  %3.1f MB capacity\n", size/1024.0/1024);
+  else if (size >=      1024)  fprintf(f, "  %3.1f KB capacity\n", size/1024.0);
+  else                         fprintf(f, "  %ld B capacity\n", size);
+  fprintf(f, "  %ld banks\n", 1L<<lg_banks);
+  fprintf(f, "  %ld bytes line size\n", 1L<<lg_line);
+  fprintf(f, "  %ld ways set associativity\n", c->associativity());
+  fprintf(f, "  %ld cycles miss penalty\n", c->penalty());
+  fprintf(f, "  %ld references\n", refs);
+  fprintf(f, "  %ld misses (%5.3f%%)\n", misses, 100.0*misses/refs);
+  fprintf(f, "  %ld stores (%5.3f%%)\n", updates, 100.0*updates/refs);
+  fprintf(f, "  %ld writebacks (%5.3f%%)\n", evictions, 100.0*evictions/refs);
 }
   
@@ -6,85 +6,259 @@
 #ifndef CACHE_T
 #define CACHE_T
 
+#include <stdint.h>
+#include <limits.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
 struct lru_fsm_t {
-  unsigned short way;		// cache way to look up 
-  unsigned short next_state;	// number if hit 
+  unsigned short way;		// cache way to look up
+  unsigned short next_state;	// number if hit
 };
 
-struct tag_t {
-  bool dirty : 1;
-  long addr : 63;
+// Tags of one row are contiguous so all ways can be compared at once.
+// Rows are padded to a multiple of the vector width with NOTAG.
+
+#if defined(__AVX512F__)
+#define VEC_WAYS  8
+#elif defined(__AVX2__)
+#define VEC_WAYS  4
+#else
+#define VEC_WAYS  1
+#endif
+
+#define NOTAG  LONG_MIN		// never equal to addr>>lg_line
+#define MAX_WAYS  64		// dirty bits in one word
+#define RRIP_MAX  3		// 2-bit re-reference prediction
+
+enum repl_t {
+  REPL_FSM,			// true LRU by state machine, 1..4 ways
+  REPL_LRU,			// true LRU by age
+  REPL_PLRU,			// tree pseudo-LRU, power of 2 ways
+  REPL_RRIP,			// static RRIP, insert at RRIP_MAX-1
 };
 
-class cache_t {		        // cache descriptor 
-  const char* name;		// for printing 
-  struct lru_fsm_t* fsm;	// LRU state transitions [ways!][ways] 
-  long line;			// line size in bytes 
-  long rows;			// number of rows 
-  long ways;			// number of ways 
-  long lg_line, lg_rows;	// specified in log-base-2 units 
-  long tag_mask;		// = ~((1<<lg_line)-1) 
-  long row_mask;		// row index mask = ((1<<lg_rows)-1) << dc->lg_line 
-  tag_t** tags;			// cache tag array [ways][rows]
-  unsigned short* states;	// LRU state vector [rows] 
-  long* evicted;		// tag of evicted line, 0 if clean, NULL if unwritable 
-  long _penalty;		// cycles to refill line 
-  long _refs, _misses;		// count number of 
+class cache_t {		        // cache descriptor
+  const char* name;		// for printing
+  struct lru_fsm_t* fsm;	// LRU state transitions [ways!][ways]
+  repl_t policy;
+  long line;			// line size in bytes
+  long rows;			// number of rows
+  long ways;			// number of ways
+  long stride;			// tags per row, ways rounded up to VEC_WAYS
+  long lg_line, lg_rows;	// specified in log-base-2 units
+  long lg_ways;			// tree-PLRU depth
+  long tag_mask;		// = ~((1<<lg_line)-1)
+  long row_mask;		// row index mask = ((1<<lg_rows)-1) << dc->lg_line
+  long* tags;			// cache tag array [rows][stride]
+  uint64_t* dirty;		// dirty bit per way [rows]
+  uint64_t* excl;		// exclusive (MESI E or M) bit per way [rows]
+  uint64_t* pref;		// prefetched, not yet referenced, bit per way [rows]
+  unsigned short* states;	// LRU state vector [rows]
+  uint8_t* ages;		// LRU age or RRIP value [rows][stride]
+  uint64_t* plru;		// tree bits, root at bit 1 [rows]
+  long _evicted;		// address of evicted line, 0 if clean
+  long _victim;			// address of replaced line, 0 if empty
+  long _lastrow;		// location of line last looked up
+  int _lastway;
+  bool _lastpref;		// last lookup hit a prefetched line
+  bool writeable;
+  long _penalty;		// cycles to refill line
+  long _refs, _misses;		// count number of
   long _updates, _evictions;	// if writeable
-  
+  long _prefetches;		// lines filled by prefetch
+  long _useful, _useless;	// prefetched lines referenced, evicted unreferenced
+
+  int find(long* row, long addr);
+  int victim(long index);
+  void touch(long index, int way);
+  void fill(long index, int way);
+
  public:
-  cache_t(const char* nam, int miss, int w, int lin, int row, bool writeable);
+  cache_t(const char* nam, int miss, int w, int lin, int row, bool writeable, const char* repl ="lru");
   bool lookup(long addr, bool write =false);
+  bool prefetch(long addr);	// fill without counting reference, true if present
   long refs() { return _refs; }
   long misses() { return _misses; }
   long updates() { return _updates; }
   long evictions() { return _evictions; }
+  long prefetches() { return _prefetches; }
+  long useful() { return _useful; }
+  long useless() { return _useless; }
   long penalty() { return _penalty; }
-  
+  long evicted() { return _evicted; } // after a miss
+  long victim() { return _victim; }
+  bool prefetched() { return _lastpref; } // by last lookup
+  bool exclusive() { return excl[_lastrow] >> _lastway & 1; } // of last lookup
+  void set_exclusive(bool e) { excl[_lastrow] = (excl[_lastrow] & ~(1UL<<_lastway)) | (uint64_t)e<<_lastway; }
+  bool invalidate(long addr);	// return true if was dirty
+  bool downgrade(long addr);	// clear exclusive, return true if was dirty
+  long lg_linesize() { return lg_line; }
+  long lg_numrows() { return lg_rows; }
+  long associativity() { return ways; }
+
   void flush();
   void show();
   void print(FILE* f =stderr);
 };
 
+inline int cache_t::find(long* row, long addr)
+{
+#if defined(__AVX512F__)
+  __m512i key = _mm512_set1_epi64(addr);
+  for (int k=0; k<stride; k+=8) {
+    __mmask8 m = _mm512_cmpeq_epi64_mask(key, _mm512_load_si512(row+k));
+    if (m)
+      return k + __builtin_ctz(m);
+  }
+#elif defined(__AVX2__)
+  __m256i key = _mm256_set1_epi64x(addr);
+  for (int k=0; k<stride; k+=4) {
+    __m256i eq = _mm256_cmpeq_epi64(key, _mm256_load_si256((__m256i*)(row+k)));
+    int m = _mm256_movemask_pd(_mm256_castsi256_pd(eq));
+    if (m)
+      return k + __builtin_ctz(m);
+  }
+#else
+  for (int k=0; k<ways; k++)
+    if (row[k] == addr)
+      return k;
+#endif
+  return -1;
+}
+
+inline void cache_t::touch(long index, int way)
+{
+  switch (policy) {
+  case REPL_LRU:
+    {
+      uint8_t* age = ages + index*stride;
+      uint8_t a = age[way];
+      for (int k=0; k<stride; k++) // padding is 0xFF so never ages
+	age[k] += (age[k] < a);
+      age[way] = 0;
+    }
+    break;
+  case REPL_PLRU:
+    {
+      uint64_t bits = plru[index];
+      long node = 1;
+      for (int lvl=lg_ways-1; lvl>=0; lvl--) {
+	long b = (way >> lvl) & 1;
+	bits = (bits & ~(1UL<<node)) | ((b^1)<<node); // point away
+	node = 2*node + b;
+      }
+      plru[index] = bits;
+    }
+    break;
+  case REPL_RRIP:
+    ages[index*stride+way] = 0;
+    break;
+  default:
+    break;
+  }
+}
+
 inline bool cache_t::lookup(long addr, bool write)
 {
   _refs++;
-  addr >>= lg_line;		// make proper tag (ok to include index) 
+  addr >>= lg_line;		// make proper tag (ok to include index)
   int index = addr & row_mask;
-  unsigned short* state = states + index;
-  struct lru_fsm_t* p = fsm + *state; // recall fsm points to [-1] 
-  struct lru_fsm_t* end = p + ways;	 // hence +ways = last entry 
-  struct tag_t* tag;
+  long* row = tags + index*stride;
+  int way;
   bool hit = true;
-  do {
-    p++;
-    tag = tags[p->way] + index;
-    //    tag = tags + index*ways + p->way;
-    if (addr == tag->addr)
-      goto cache_hit;
-  } while (p < end);
-  hit = false;
-  tag->addr = addr;
-  _misses++;
-  if (tag->dirty) {
-    *evicted = tag->addr;	// will SEGV if not cache not writable 
-    _evictions++;		// can conveniently point to your location 
-    tag->dirty = 0;
+  if (policy == REPL_FSM) {
+    unsigned short* state = states + index;
+    struct lru_fsm_t* p = fsm + *state; // recall fsm points to [-1]
+    struct lru_fsm_t* end = p + ways;	 // hence +ways = last entry
+    do {
+      p++;
+      way = p->way;
+      if (addr == row[way])
+	goto fsm_hit;
+    } while (p < end);
+    hit = false;
+  fsm_hit:
+    *state = p->next_state;	// already multiplied by ways
+  }
+  else if ((way = find(row, addr)) >= 0)
+    touch(index, way);
+  else {
+    hit = false;
+    way = victim(index);
+    fill(index, way);
   }
-  else if (evicted)
-    *evicted = 0;
-  tag->addr = addr;
-  
- cache_hit:
-  *state = p->next_state;	// already multiplied by ways
+  if (!hit) {
+    _misses++;
+    if (dirty[index] >> way & 1) {
+      _evicted = row[way] << lg_line;
+      _evictions++;
+      dirty[index] &= ~(1UL << way);
+    }
+    else
+      _evicted = 0;
+    _victim = row[way] == NOTAG ? 0 : row[way] << lg_line;
+    excl[index] &= ~(1UL << way);
+    row[way] = addr;
+  }
+  uint64_t bit = 1UL << way;
+  _lastpref = hit && (pref[index] & bit);
+  if (pref[index] & bit) {	// first reference, or evicted unused
+    pref[index] &= ~bit;
+    if (hit)
+      _useful++;
+    else
+      _useless++;
+  }
+  _lastrow = index;
+  _lastway = way;
   if (write) {
-    tag->dirty = 1;
+    dirty[index] |= 1UL << way;
     _updates++;
   }
   return hit;
 }
 
 
+// Banked cache shared by all cores.  Each bank is an ordinary cache_t
+// holding the lines whose low line address bits equal the bank number,
+// guarded by its own spinlock.
+
+class shared_cache_t {
+  struct bank_t {
+    volatile int lock;
+    cache_t* c;
+  } __attribute__((aligned(64)));
+  const char* name;
+  bank_t* banks;
+  long lg_banks;
+  long lg_line;
+ public:
+  shared_cache_t(const char* nam, int miss, int w, int lin, int row, int lg_bank, const char* repl ="lru");
+  bool lookup(long addr, bool write, long* evicted);
+  long penalty() { return banks[0].c->penalty(); }
+  void print(FILE* f =stderr);
+};
+
+inline bool shared_cache_t::lookup(long addr, bool write, long* evicted)
+{
+  long bank = (addr >> lg_line) & ((1L<<lg_banks)-1);
+  long a = (addr >> (lg_line+lg_banks)) << lg_line;	// squeeze out bank bits
+  bank_t* b = &banks[bank];
+  while (__sync_lock_test_and_set(&b->lock, 1))
+    while (b->lock)
+      ;
+  bool hit = b->c->lookup(a, write);
+  long ev = hit ? 0 : b->c->evicted();
+  __sync_lock_release(&b->lock);
+  if (ev)
+    ev = ((ev >> lg_line) << (lg_line+lg_banks)) | (bank << lg_line);
+  *evicted = ev;
+  return hit;
+}
+
+
 void flush_cache();
 void init_cache();
 void show_cache();
@@ -0,0 +1,123 @@
+/*
+  Copyright (c) 2021 Peter Hsu.  All Rights Reserved.  See LICENCE file for details.
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "coherence.h"
+
+directory_t::directory_t(int lin, int lg_sets)
+{
+  lg_line = lin;
+  set_mask = (1L<<lg_sets) - 1;
+  sets = new dir_set_t[1L<<lg_sets];
+  memset((char*)sets, 0, (1L<<lg_sets)*sizeof(dir_set_t));
+  memset((char*)inbox, 0, sizeof inbox);
+  _evictions = 0;
+}
+
+directory_t::dir_set_t* directory_t::lock(long line)
+{
+  dir_set_t* s = &sets[(line ^ line>>17) & set_mask];
+  while (__sync_lock_test_and_set(&s->lock, 1))
+    while (s->lock)
+      ;
+  return s;
+}
+
+void directory_t::send(long core, long line, long kind)
+{
+  coh_msg_t* m = new coh_msg_t;
+  m->addr = line << lg_line;
+  m->kind = kind;
+  coh_msg_t* h;
+  do {
+    h = inbox[core].head;
+    m->next = h;
+  } while (!__sync_bool_compare_and_swap(&inbox[core].head, h, m));
+}
+
+// Find or allocate entry for line, displacing another entry
+// (and invalidating all its copies) if the set is full.
+
+dir_entry_t* directory_t::entry(dir_set_t* s, long line)
+{
+  dir_entry_t* free = 0;
+  for (int k=0; k<DIR_WAYS; k++) {
+    if (s->e[k].line == line)
+      return &s->e[k];
+    if (!free && s->e[k].line == 0)
+      free = &s->e[k];
+  }
+  if (!free) {
+    free = &s->e[s->next_victim];
+    s->next_victim = (s->next_victim + 1) % DIR_WAYS;
+    for (long c=0; c<MAX_COHERENT_CORES; c++)
+      if (free->sharers >> c & 1)
+	send(c, free->line, MSG_INVALIDATE);
+    __sync_fetch_and_add(&_evictions, 1);
+  }
+  free->line = line;
+  free->sharers = 0;
+  free->owner = -1;
+  return free;
+}
+
+int directory_t::read(long core, long addr)
+{
+  long line = addr >> lg_line;
+  dir_set_t* s = lock(line);
+  dir_entry_t* e = entry(s, line);
+  int flags = 0;
+  if (e->owner >= 0 && e->owner != core) {
+    send(e->owner, line, MSG_DOWNGRADE);
+    e->owner = -1;
+    flags |= COH_C2C;
+  }
+  e->sharers |= 1UL << core;
+  if (e->sharers == 1UL << core) {
+    e->owner = core;
+    flags |= COH_EXCL;
+  }
+  unlock(s);
+  return flags;
+}
+
+int directory_t::write(long core, long addr)
+{
+  long line = addr >> lg_line;
+  dir_set_t* s = lock(line);
+  dir_entry_t* e = entry(s, line);
+  int flags = COH_EXCL;
+  if (e->owner >= 0 && e->owner != core)
+    flags |= COH_C2C;
+  uint64_t others = e->sharers & ~(1UL << core);
+  for (long c=0; others; c++, others>>=1)
+    if (others & 1)
+      send(c, line, MSG_INVALIDATE);
+  e->sharers = 1UL << core;
+  e->owner = core;
+  unlock(s);
+  return flags;
+}
+
+void directory_t::evict(long core, long addr)
+{
+  long line = addr >> lg_line;
+  dir_set_t* s = lock(line);
+  for (int k=0; k<DIR_WAYS; k++) {
+    dir_entry_t* e = &s->e[k];
+    if (e->line == line) {
+      e->sharers &= ~(1UL << core);
+      if (e->owner == core)
+	e->owner = -1;
+      if (e->sharers == 0)
+	e->line = 0;
+      break;
+    }
+  }
+  unlock(s);
+}
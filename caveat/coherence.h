@@ -0,0 +1,65 @@
+/*
+  Copyright (c) 2021 Peter Hsu.  All Rights Reserved.  See LICENCE file for details.
+*/
+
+#ifndef COHERENCE_H
+#define COHERENCE_H
+
+// MESI directory for per-core data caches.  The directory is set
+// associative with a spinlock per set, so cores touching different
+// lines rarely contend.  A core never modifies another core's cache
+// directly: invalidate and downgrade requests are pushed onto the
+// target core's lock-free inbox and applied by that core's own thread
+// at its next memory reference.
+
+#define DIR_WAYS  8
+#define MAX_COHERENT_CORES  64	// sharer bits in one word
+
+#define COH_EXCL  0x1		// requester may write (E or M)
+#define COH_C2C   0x2		// data supplied by another core's cache
+
+#define MSG_INVALIDATE  0
+#define MSG_DOWNGRADE   1
+
+struct coh_msg_t {
+  coh_msg_t* next;
+  long addr;			// line address
+  long kind;			// MSG_INVALIDATE or MSG_DOWNGRADE
+};
+
+struct dir_entry_t {
+  long line;			// line number, 0 if free
+  uint64_t sharers;		// bit per core holding line
+  long owner;			// core with E or M copy, -1 if none
+};
+
+class directory_t {
+  struct dir_set_t {
+    volatile int lock;
+    int next_victim;		// round-robin replacement
+    dir_entry_t e[DIR_WAYS];
+  } __attribute__((aligned(64)));
+  struct inbox_t {
+    coh_msg_t* volatile head;
+  } __attribute__((aligned(64)));
+  dir_set_t* sets;
+  long set_mask;
+  long lg_line;
+  inbox_t inbox[MAX_COHERENT_CORES];
+  volatile long _evictions;	// directory entries displaced
+
+  dir_set_t* lock(long line);
+  void unlock(dir_set_t* s) { __sync_lock_release(&s->lock); }
+  dir_entry_t* entry(dir_set_t* s, long line);
+  void send(long core, long line, long kind);
+public:
+  directory_t(int lin, int lg_sets);
+  int read(long core, long addr);	// returns COH_ flags
+  int write(long core, long addr);	// miss or upgrade
+  void evict(long core, long addr);
+  bool pending(long core) { return inbox[core].head != 0; }
+  coh_msg_t* receive(long core) { return __atomic_exchange_n(&inbox[core].head, (coh_msg_t*)0, __ATOMIC_ACQUIRE); }
+  long evictions() { return _evictions; }
+};
+
+#endif
@@ -0,0 +1,103 @@
+/*
+  Copyright (c) 2021 Peter Hsu.  All Rights Reserved.  See LICENCE file for details.
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "options.h"
+#include "uspike.h"
+#include "dram.h"
+
+dram_t::dram_t(int lin, int lg_ch, int lg_bk, int lg_rowbytes, long cas, long rcd, long rp, long burst)
+{
+  quitif(lg_rowbytes < lin, "DRAM row smaller than cache line");
+  lg_line = lin;
+  lg_channels = lg_ch;
+  lg_banks = lg_bk;
+  lg_row = lg_rowbytes;
+  tCAS = cas;
+  tRCD = rcd;
+  tRP = rp;
+  tBURST = burst;
+  channel = new dram_channel_t[1L<<lg_channels];
+  memset((char*)channel, 0, (1L<<lg_channels)*sizeof(dram_channel_t));
+  for (long c=0; c<(1L<<lg_channels); c++) {
+    channel[c].bank = new dram_bank_t[1L<<lg_banks];
+    for (long b=0; b<(1L<<lg_banks); b++) {
+      channel[c].bank[b].open_row = -1;
+      channel[c].bank[b].ready = 0;
+    }
+  }
+}
+
+// Address bits, low to high: line offset, channel, column within row,
+// bank, row.
+
+long dram_t::access(long a, long now, bool write)
+{
+  long line = a >> lg_line;
+  dram_channel_t* c = &channel[line & ((1L<<lg_channels)-1)];
+  long k = line >> (lg_channels + lg_row - lg_line);
+  dram_bank_t* b = &c->bank[k & ((1L<<lg_banks)-1)];
+  long row = k >> lg_banks;
+  while (__sync_lock_test_and_set(&c->lock, 1))
+    while (c->lock)
+      ;
+  long start = now > b->ready ? now : b->ready;
+  long lat = tCAS;
+  if (b->open_row == row)
+    c->_hits++;
+  else if (b->open_row < 0) {
+    lat += tRCD;
+    c->_empty++;
+  }
+  else {
+    lat += tRP + tRCD;
+    c->_conflicts++;
+  }
+  b->open_row = row;
+  b->ready = start + lat - tCAS + tBURST; // next column command
+  long data = start + lat;
+  if (c->busy > data) {
+    c->_queued += c->busy - data;
+    data = c->busy;
+  }
+  c->busy = data + tBURST;
+  long done = data + tBURST - now;
+  if (write)
+    c->_writes++;
+  else {
+    c->_reads++;
+    c->_latency += done;
+  }
+  __sync_lock_release(&c->lock);
+  return done;
+}
+
+void dram_t::print(FILE* f)
+{
+  long reads=0, writes=0, hits=0, empty=0, conflicts=0, latency=0, queued=0;
+  for (long k=0; k<(1L<<lg_channels); k++) {
+    dram_channel_t* c = &channel[k];
+    reads += c->_reads;
+    writes += c->_writes;
+    hits += c->_hits;
+    empty += c->_empty;
+    conflicts += c->_conflicts;
+    latency += c->_latency;
+    queued += c->_queued;
+  }
+  long n = reads + writes;
+  fprintf(f, "DRAM\n");
+  fprintf(f, "  %ld channels, %ld banks each, %ld byte rows\n", 1L<<lg_channels, 1L<<lg_banks, 1L<<lg_row);
+  fprintf(f, "  CAS %ld, RCD %ld, RP %ld, burst %ld cycles\n", tCAS, tRCD, tRP, tBURST);
+  fprintf(f, "  %ld reads, %ld writes\n", reads, writes);
+  fprintf(f, "  %ld row hits (%5.3f%%)\n", hits, 100.0*hits/n);
+  fprintf(f, "  %ld row empty (%5.3f%%)\n", empty, 100.0*empty/n);
+  fprintf(f, "  %ld row conflicts (%5.3f%%)\n", conflicts, 100.0*conflicts/n);
+  fprintf(f, "  %5.1f cycles average read latency\n", (double)latency/reads);
+  fprintf(f, "  %5.1f cycles average bus queueing\n", (double)queued/n);
+}
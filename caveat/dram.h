@@ -0,0 +1,45 @@
+/*
+  Copyright (c) 2021 Peter Hsu.  All Rights Reserved.  See LICENCE file for details.
+*/
+
+#ifndef DRAM_H
+#define DRAM_H
+
+// Main memory behind the last cache level, shared by all cores.
+// Lines interleave across channels; within a channel, consecutive
+// lines fill a row buffer before moving to the next bank.  Each bank
+// keeps its row open.  An access waits for its bank, pays CAS for an
+// open row hit, RCD+CAS for a closed bank or RP+RCD+CAS for a row
+// conflict, then queues for the channel's data bus, which is busy for
+// a burst per line.  Latency therefore rises with load: requests from
+// every core serialize on the same buses.  Times are core cycles, so
+// contention between cores is meaningful when --quantum keeps their
+// clocks together.  Each channel has its own spinlock.
+
+struct dram_bank_t {
+  long open_row;		// -1 if precharged
+  long ready;			// cycle next command may issue
+};
+
+struct dram_channel_t {
+  volatile int lock;
+  long busy;			// data bus free at this cycle
+  dram_bank_t* bank;
+  long _reads, _writes;
+  long _hits, _empty, _conflicts;
+  long _latency, _queued;	// total read cycles, waiting for bus
+} __attribute__((aligned(64)));
+
+class dram_t {
+  dram_channel_t* channel;
+  int lg_line, lg_channels, lg_banks, lg_row;
+  long tCAS, tRCD, tRP, tBURST;
+  long access(long a, long now, bool write);
+public:
+  dram_t(int lin, int lg_ch, int lg_bk, int lg_rowbytes, long cas, long rcd, long rp, long burst);
+  long read(long a, long now) { return access(a, now, false); } // cycles until line arrives
+  void write(long a, long now) { access(a, now, true); }
+  void print(FILE* f =stderr);
+};
+
+#endif
@@ -0,0 +1,145 @@
+/*
+  Copyright (c) 2021 Peter Hsu.  All Rights Reserved.  See LICENCE file for details.
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "options.h"
+#include "uspike.h"
+#include "instructions.h"
+#include "ooo.h"
+
+static char op_class[Op_UNKNOWN+1];
+
+// Loads and stores are recognized when the memory hooks are called,
+// so only computational instructions need classifying by name.
+
+static void init_op_class()
+{
+  for (int op=0; op<=Op_UNKNOWN; op++) {
+    const char* n = op_name[op];
+    if (!n)
+      continue;
+    if (strncmp(n, "mul", 3) == 0)
+      op_class[op] = OOO_MUL;
+    else if (strncmp(n, "div", 3) == 0 || strncmp(n, "rem", 3) == 0)
+      op_class[op] = OOO_DIV;
+    else if (strncmp(n, "fdiv", 4) == 0 || strncmp(n, "fsqrt", 5) == 0)
+      op_class[op] = OOO_FDIV;
+    else if (n[0] == 'f' && strncmp(n, "fence", 5) != 0)
+      op_class[op] = OOO_FPU;
+    else
+      op_class[op] = OOO_ALU;
+  }
+}
+
+ooo_t::ooo_t(long w, long rob_entries, long lsq_entries, const long lat[OOO_CLASSES])
+{
+  static bool initialized = false;
+  if (!initialized) {
+    init_op_class();
+    initialized = true;
+  }
+  quitif(w < 1 || rob_entries < 1 || lsq_entries < 1, "width, ROB and LSQ must be positive");
+  width = w;
+  rob_size = rob_entries;
+  lsq_size = lsq_entries;
+  rob = new long[rob_size];
+  memset(rob, 0, rob_size*sizeof(long));
+  lsq = new long[lsq_size];
+  memset(lsq, 0, lsq_size*sizeof(long));
+  insns = memops = 0;
+  memcpy(latency, lat, sizeof latency);
+  memset(ready, 0, sizeof ready);
+  fetched = 0;
+  dispatch_cycle = dispatched = 0;
+  retire_cycle = retired = 0;
+  _pc = 0;
+  fetch_delay = mem_delay = 0;
+  mem_kind = 0;
+  redirect_delay = mispredict_delay = 0;
+  _rob_full = _lsq_full = _mispredicts = 0;
+}
+
+long ooo_t::resolve()
+{
+  Insn_t i = code.at(_pc);
+  // dispatch, in order
+  if (fetch_delay)
+    fetched = (fetched > dispatch_cycle ? fetched : dispatch_cycle) + fetch_delay;
+  long t = fetched > dispatch_cycle ? fetched : dispatch_cycle;
+  long* rb = &rob[insns++ % rob_size];
+  if (*rb > t) {
+    t = *rb;
+    _rob_full++;
+  }
+  long* q = 0;
+  if (mem_kind) {
+    q = &lsq[memops++ % lsq_size];
+    if (*q > t) {
+      t = *q;
+      _lsq_full++;
+    }
+  }
+  if (t > dispatch_cycle) {
+    dispatch_cycle = t;
+    dispatched = 0;
+  }
+  long dispatch = dispatch_cycle;
+  if (++dispatched == width) {
+    dispatch_cycle++;
+    dispatched = 0;
+  }
+  // execute when operands ready
+  long start = dispatch + 1;
+  int rs[3] = { i.rs1(), NOREG, NOREG };
+  if (!i.longimmed()) {
+    rs[1] = i.rs2();
+    rs[2] = i.rs3();
+  }
+  for (int k=0; k<3; k++)
+    if ((unsigned)rs[k] < OOO_REGS && ready[rs[k]] > start)
+      start = ready[rs[k]];
+  long done = start;
+  if (mem_kind == OOO_LOAD)
+    done += latency[OOO_LOAD] + mem_delay;
+  else if (mem_kind == OOO_STORE)
+    done += 1;			// miss drains from store queue
+  else
+    done += latency[op_class[i.opcode()]];
+  if (i.rd() > 0 && i.rd() < OOO_REGS)
+    ready[i.rd()] = done;
+  // retire, in order
+  if (done > retire_cycle) {
+    retire_cycle = done;
+    retired = 0;
+  }
+  long retire = retire_cycle;
+  if (++retired == width) {
+    retire_cycle++;
+    retired = 0;
+  }
+  *rb = retire;
+  if (q)
+    *q = retire + (mem_kind == OOO_STORE ? mem_delay : 0);
+  // where front end continues
+  if (mispredict_delay) {
+    fetched = done + mispredict_delay;
+    _mispredicts++;
+  }
+  else if (redirect_delay && dispatch + redirect_delay > fetched)
+    fetched = dispatch + redirect_delay;
+  return retire;
+}
+
+void ooo_t::print(FILE* f)
+{
+  fprintf(f, "Out-of-order core width %ld, ROB %ld, LSQ %ld\n", width, rob_size, lsq_size);
+  fprintf(f, "  %ld instructions\n", insns);
+  fprintf(f, "  %ld dispatch stalls ROB full\n", _rob_full);
+  fprintf(f, "  %ld dispatch stalls LSQ full\n", _lsq_full);
+  fprintf(f, "  %ld pipeline flushes\n", _mispredicts);
+}
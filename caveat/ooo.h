@@ -0,0 +1,72 @@
+/*
+  Copyright (c) 2021 Peter Hsu.  All Rights Reserved.  See LICENCE file for details.
+*/
+
+#ifndef OOO_H
+#define OOO_H
+
+// Superscalar out-of-order core timing, one instance per core.
+// Instructions arrive in program order.  Each dispatches once the front
+// end has delivered it, the reorder buffer (and for memory operations
+// the load/store queue) has room, and fewer than width instructions
+// dispatched that cycle.  It executes when its source registers are
+// ready, completes after its functional unit latency plus any cache
+// miss penalty, and retires in order, width per cycle.  Model hooks for
+// an instruction arrive while it executes, so its timing is resolved
+// when the next instruction begins.
+
+#define OOO_REGS  VPREG		// integer and floating point registers
+
+#define OOO_ALU      0		// latency classes
+#define OOO_MUL      1
+#define OOO_DIV      2
+#define OOO_FPU      3
+#define OOO_FDIV     4
+#define OOO_LOAD     5
+#define OOO_CLASSES  6
+
+#define OOO_STORE    OOO_CLASSES // pending memory operation kind
+
+class ooo_t {
+  long width;
+  long rob_size, lsq_size;
+  long* rob;			// retire cycle of recent instructions
+  long* lsq;			// release cycle of recent memory operations
+  long insns, memops;
+  long latency[OOO_CLASSES];
+  long ready[OOO_REGS];		// cycle register value available
+  long fetched;			// cycle front end delivers next instruction
+  long dispatch_cycle, dispatched;
+  long retire_cycle, retired;
+  long _pc;			// instruction being executed, 0 if none
+  long fetch_delay;		// instruction cache miss
+  long mem_delay;		// data cache miss
+  int mem_kind;			// 0, OOO_LOAD or OOO_STORE
+  long redirect_delay;		// known at decode
+  long mispredict_delay;	// known after execute
+  long _rob_full, _lsq_full, _mispredicts;
+  long resolve();
+public:
+  ooo_t(long w, long rob_entries, long lsq_entries, const long lat[OOO_CLASSES]);
+  long pc() { return _pc; }
+  long insn(long pc, long fetch_penalty); // returns retire cycle of previous
+  void load(long penalty)  { mem_kind = OOO_LOAD;  mem_delay += penalty; }
+  void store(long penalty) { mem_kind = OOO_STORE; mem_delay += penalty; }
+  void redirect(long cycles)   { redirect_delay = cycles; }
+  void mispredict(long cycles) { mispredict_delay = cycles; }
+  void advance(long t) { if (t > fetched) fetched = t; } // time passed elsewhere
+  void print(FILE* f =stderr);
+};
+
+inline long ooo_t::insn(long pc, long fetch_penalty)
+{
+  long t = _pc ? resolve() : 0;
+  _pc = pc;
+  fetch_delay = fetch_penalty;
+  mem_delay = 0;
+  mem_kind = 0;
+  redirect_delay = mispredict_delay = 0;
+  return t;
+}
+
+#endif
@@ -3,44 +3,200 @@
 */
 
 #include <unistd.h>
+#include <string.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/mman.h>
 
 #include "options.h"
 #include "uspike.h"
+#include "instructions.h"
 #include "perf.h"
 
 perf_header_t* perf_t::h;
 
+// Each core's sequence numbers start on their own cache line.
+
+static long seqbytes(long chunks) { return (chunks*sizeof(long) + 63) & ~63L; }
+
 perf_t::perf_t(long n)
 {
   if (n >= h->_cores)
     fprintf(stderr, "perf_t(%ld) greater than allocated cores=%ld\n", n, h->_cores);
   else {
-    volatile char* ptr = h->arrays + n*h->parcels*(sizeof(count_t)+2*sizeof(long));
-    _count = (volatile count_t*)ptr;
-    _imiss = (volatile long*)(ptr + h->parcels*sizeof(count_t));
-    _dmiss = (volatile long*)(_imiss + h->parcels);
+    _ctr = (volatile long*)((char*)h + h->arrays + n*h->region);
+    _seq = (volatile long*)((char*)h + h->seqs + n*seqbytes(h->chunks));
+    _ring = (perf_ring_t*)((char*)h + h->rings) + n;
+  }
+  _view = _ctr;
+  _snap[0] = _snap[1] = 0;
+  _pending = 0;
+  _dirty = 0;
+  _open = 0;
+  _ndirty = _batched = _published = 0;
+  _base = h->base;
+  _map = h->map;
+  _width = 0;
+  for (int f=0; f<PERF_FIELDS; f++)
+    _off[f] = (h->fields & (1<<f)) ? _width++ : -1;
+}
+
+void perf_t::batch()
+{
+  _pending = new long[PERF_PENDING*(_width+1)];
+  memset(_pending, 0, PERF_PENDING*(_width+1)*sizeof(long));
+  _dirty = new long[PERF_PENDING];
+  _open = new long[PERF_PENDING];
+}
+
+// Add counts of entry p to the segment so it can hold another slot.
+
+void perf_t::evict(long* p)
+{
+  long i = p[0]-1;
+  volatile long* s = &_seq[i / PERF_CHUNK];
+  (*s)++;			// odd, readers retry
+  __sync_synchronize();
+  volatile long* c = &_ctr[i*_width];
+  for (long f=0; f<_width; f++)
+    c[f] += p[1+f];
+  __sync_synchronize();
+  (*s)++;
+  memset(p+1, 0, _width*sizeof(long));
+}
+
+void perf_t::publish()
+{
+  long nopen = 0;
+  for (long k=0; k<_ndirty; k++) {
+    long c = (_pending[_dirty[k]*(_width+1)]-1) / PERF_CHUNK;
+    if (!(_seq[c] & 1)) {
+      _seq[c]++;		// odd, readers retry
+      _open[nopen++] = c;
+    }
+  }
+  __sync_synchronize();
+  for (long k=0; k<_ndirty; k++) {
+    long* p = &_pending[_dirty[k]*(_width+1)];
+    volatile long* c = &_ctr[(p[0]-1)*_width];
+    for (long f=0; f<_width; f++)
+      c[f] += p[1+f];
+    memset(p, 0, (_width+1)*sizeof(long));
+  }
+  __sync_synchronize();
+  for (long k=0; k<nopen; k++)
+    _seq[_open[k]]++;
+  _ndirty = 0;
+  _published += _batched;
+  _batched = 0;
+}
+
+// Copy into the older buffer, which then becomes current.
+
+void perf_t::snapshot()
+{
+  long n = h->insns*_width;
+  if (!_snap[0]) {
+    _snap[0] = new long[n];
+    memset(_snap[0], 0, n*sizeof(long));
   }
+  long* buf = _snap[1] ? _snap[1] : new long[n];
+  long step = PERF_CHUNK*_width;
+  for (long c=0; c<h->chunks; c++) {
+    long lo = c*step;
+    long len = (lo+step < n ? step : n-lo) * sizeof(long);
+    for (long tries=0; tries<PERF_RETRIES; tries++) {
+      long s = _seq[c];
+      __sync_synchronize();
+      memcpy(buf+lo, (long*)_ctr+lo, len);
+      __sync_synchronize();
+      if (!(s & 1) && _seq[c] == s)
+	break;
+    }
+  }
+  _snap[1] = _snap[0];
+  _snap[0] = buf;
+  _view = buf;
 }
 
-void perf_t::create(long base, long bound, long n, const char* shm_name)
+void perf_t::record(const interval_t* r)
 {
-  long sz = sizeof(perf_header_t);
+  long head = _ring->head;
+  _ring->rec[head % PERF_INTERVALS] = *r;
+  __sync_synchronize();
+  _ring->head = head + 1;
+}
+
+// Slot head is being written, so at most PERF_INTERVALS-1 records are
+// safe, and fewer if the writer moved on while we copied.
+
+long perf_t::intervals(interval_t* buf, long max)
+{
+  long head = _ring->head;
+  __sync_synchronize();
+  long n = head;
+  if (n > PERF_INTERVALS-1)
+    n = PERF_INTERVALS-1;
+  if (n > max)
+    n = max;
+  long first = head - n;
+  for (long k=0; k<n; k++)
+    buf[k] = _ring->rec[(first+k) % PERF_INTERVALS];
+  __sync_synchronize();
+  long lost = _ring->head - (PERF_INTERVALS-1) - first;
+  if (lost <= 0)
+    return n;
+  if (lost >= n)
+    return 0;
+  memmove(buf, buf+lost, (n-lost)*sizeof(interval_t));
+  return n - lost;
+}
+
+static long align(long n) { return (n + PERF_ALIGN-1) & ~(PERF_ALIGN-1); }
+
+// Text must already be loaded: instruction lengths come from the image.
+
+void perf_t::create(long base, long bound, long n, long fields, const char* shm_name)
+{
+  fields |= PERF_ALWAYS;
+  long width = __builtin_popcountl(fields);
   long p = (bound-base)/2;
-  sz += p*n*sizeof(count_t);	// execution counters
-  sz += 2*p*n*sizeof(long);	// cache miss counters
+  long insns = 0;
+  for (long pc=base; pc<bound; pc+=code.length(pc))
+    insns++;
+  long chunks = (insns + PERF_CHUNK-1) / PERF_CHUNK;
+  long seqs = (sizeof(perf_header_t) + p*sizeof(int) + 63) & ~63L;
+  long rings = seqs + n*seqbytes(chunks);
+  long arrays = align(rings + n*sizeof(perf_ring_t));
+  long region = align(insns*width*sizeof(long));
+  long sz = arrays + n*region;
   int fd = shm_open(shm_name, O_CREAT|O_TRUNC|O_RDWR, S_IRWXU);
   dieif(fd<0, "shm_open() failed");
-  dieif(ftruncate(fd, sz)<0, "ftruncate() failed");
+  dieif(ftruncate(fd, sz)<0, "ftruncate() failed"); // zero filled
   h = (perf_header_t*)mmap(0, sz, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
-  dieif(h==0, "mmap() failed");
-  memset(h, 0, sz);
+  dieif(h==MAP_FAILED, "mmap() failed");
+  madvise((void*)h, sz, MADV_HUGEPAGE); // best effort
   h->size = sz;
   h->base = base;
   h->parcels = p;
   h->_cores = n;
+  h->insns = insns;
+  h->fields = fields;
+  h->width = width;
+  h->region = region;
+  h->chunks = chunks;
+  h->seqs = seqs;
+  h->rings = rings;
+  h->arrays = arrays;
+  long slot = 0;
+  for (long pc=base; pc<bound; pc+=code.length(pc)) {
+    h->map[(pc-base)/2] = slot;
+    if (code.length(pc) == 4 && pc+2 < bound)
+      h->map[(pc+2-base)/2] = slot;
+    slot++;
+  }
+  h->version = PERF_VERSION;
+  h->magic = PERF_MAGIC;
 }
 
 void perf_t::open(const char* shm_name)
@@ -48,15 +204,16 @@ void perf_t::open(const char* shm_name)
   int fd = shm_open(shm_name, O_RDONLY, 0);
   dieif(fd<0, "shm_open() failed in perf_open");
   h = (perf_header_t*)mmap(0, sizeof(perf_header_t), PROT_READ, MAP_SHARED, fd, 0);
-  dieif(h==0, "first mmap() failed");
+  dieif(h==MAP_FAILED, "first mmap() failed");
+  quitif(h->magic != PERF_MAGIC, "%s is not a caveat performance segment", shm_name);
+  quitif(h->version != PERF_VERSION, "%s is format version %ld, expecting %d", shm_name, h->version, PERF_VERSION);
   long sz = h->size;
   dieif(munmap((void*)h, sizeof(perf_header_t))<0, "munmap() failed");
   h = (perf_header_t*)mmap(0, sz, PROT_READ, MAP_SHARED, fd, 0);
-  dieif(h==0, "second mmap() failed");
+  dieif(h==MAP_FAILED, "second mmap() failed");
 }
 
 void perf_t::close(const char* shm_name)
 {
   shm_unlink(shm_name);
 }
-  
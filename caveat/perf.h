@@ -2,37 +2,167 @@
   Copyright (c) 2021 Peter Hsu.  All Rights Reserved.  See LICENCE file for details.
 */
 
+// Segment layout: header, then map from 2B parcel to counter slot (one
+// slot per instruction, both parcels of a 4B instruction share it),
+// then sequence numbers for each core, then one region per core of
+// counter slots.  A slot holds only the counters whose model is on,
+// listed in fields, so its width is 4 to 7 longs.  Each region starts
+// on a PERF_ALIGN boundary so a core's counters can live in huge pages
+// and never share a page with another core's.
+//
+// Each chunk of PERF_CHUNK slots has its own sequence number.  A core
+// changes its region only in publish(), which makes the number of every
+// chunk it touches odd, adds its counts, then makes them even again.
+// snapshot() copies chunk by chunk, retrying one whose number was odd
+// or changed, so each chunk it sees comes from one instant and a
+// retry costs one chunk, not the region.  After PERF_RETRIES it keeps
+// the torn copy rather than wait on a busy core.
+//
+// Between the sequence numbers and the regions, each core also has a
+// ring of interval_t samples of its progress over time.  The core
+// fills the slot at head then advances head, so it never waits; a
+// reader keeps only records head has not since lapped.
+
+#define PERF_MAGIC    0x66726570766163L	// "cavperf"
+#define PERF_VERSION  6
+#define PERF_ALIGN    (2L<<20)		// huge page
+
 struct perf_header_t {		// performance segment header
+  long magic;			// PERF_MAGIC, first so any reader can check
+  long version;			// PERF_VERSION
   long size;			// of shared memory segment in bytes
   long parcels;			// length of text segment (2B parcels)
   long base;			// address of code segment
   long _cores;			// number of simulated cores allocated
-  volatile char arrays[0];	// beginning of dynamic arrays
+  long insns;			// counter slots per core
+  long fields;			// bit mask of counters present
+  long width;			// longs per slot
+  long region;			// bytes per core, multiple of PERF_ALIGN
+  long chunks;			// sequence numbers per core
+  long seqs;			// offset of first core's sequence numbers
+  long rings;			// offset of perf_ring_t per core
+  long arrays;			// offset of first core's region
+  int map[0];			// slot of parcel
 };
 
-struct count_t {		// perinstruction counters
-  volatile long executed;	// number of times executed
-  volatile long cycles;		// total number of cycles
+enum perf_field_t {		// counters of one instruction
+  PERF_EXECUTED,		// number of times executed
+  PERF_CYCLES,			// total number of cycles
+  PERF_IMISS,
+  PERF_DMISS,
+  PERF_CMISS,			// coherence misses
+  PERF_BMISS,			// branch mispredictions
+  PERF_TMISS,			// L1 TLB misses
+  PERF_FIELDS
 };
 
+#define PERF_ALWAYS  ((1<<PERF_EXECUTED)|(1<<PERF_CYCLES)|(1<<PERF_IMISS)|(1<<PERF_DMISS))
+
+#define PERF_CHUNK    512	// slots per sequence number
+#define PERF_RETRIES  100	// before accepting a torn chunk
+
+#define PERF_INTERVALS  4096	// samples kept per core
+
+struct interval_t {		// one sample of a core's progress
+  long instructions;		// during interval
+  long cycles;
+  long imiss;
+  long dmiss;
+  long syscalls;
+  long end;			// core clock at end of interval
+};
+
+struct perf_ring_t {
+  volatile long head;		// number of records ever written
+  long pad[7];
+  interval_t rec[PERF_INTERVALS];
+};
+
+#define PERF_BATCH    (1L<<16)	// instructions between publishing
+#define PERF_PENDING  4096	// private slots per core, direct mapped
+
 class perf_t {			// pointers into shared memory structure
   static perf_header_t* h;	// shared segment
-  volatile count_t* _count;
-  volatile long* _imiss;
-  volatile long* _dmiss;
-  long index(long pc) { checkif(h->base<=pc && (pc-h->base)/2<h->parcels); return (pc - h->base) / 2; }
+  volatile long* _ctr;
+  volatile long* _seq;		// per chunk, odd while publishing
+  long* _open;			// chunks made odd by publish(), PERF_PENDING
+  perf_ring_t* _ring;
+  volatile long* _view;		// what accessors read
+  long* _snap[2];		// current and previous snapshot
+  long* _pending;		// NULL unless batching, entries of slot+1 then width counts
+  long* _dirty;			// occupied entries of _pending
+  long _ndirty;
+  long _batched;		// instructions since publish()
+  long _published;		// instructions in segment
+  long _base;
+  long _width;
+  int* _map;
+  signed char _off[PERF_FIELDS];	// of field in slot, -1 if absent
+  long index(long pc) { checkif(h->base<=pc && (pc-h->base)/2<h->parcels); return h->map[(pc-h->base)/2]*_width; }
+  long get(long pc, int f) { return _off[f] < 0 ? 0 : _view[index(pc)+_off[f]]; }
+  void inc(long pc, int f, long k) { if (_off[f] >= 0) _ctr[index(pc)+_off[f]] += k; }
+  void add(long pc, int f, long k) { if (_off[f] >= 0) pending(pc)[_off[f]] += k; }
+  long* pending(long pc);
+  void evict(long* p);
 public:
   perf_t(long n);		// initialize as core n
-  static void create(long base, long bound, long n, const char* shm_name);
+  static void create(long base, long bound, long n, long fields, const char* shm_name);
   static void open(const char* shm_name);
   static void close(const char* shm_name);
   static long cores() { return h->_cores; }
-  long count(long pc) { return _count[index(pc)].executed; }
-  long cycle(long pc) { return _count[index(pc)].cycles;   }
-  long imiss(long pc) { return _imiss[index(pc)]; }
-  long dmiss(long pc) { return _dmiss[index(pc)]; }
-  void inc_count( long pc, long k =1) { _count[index(pc)].executed += k; }
-  void inc_cycle( long pc, long k =1) { _count[index(pc)].cycles   += k; }
-  void inc_imiss( long pc, long k =1) { _imiss[index(pc)] += k; }
-  void inc_dmiss( long pc, long k =1) { _dmiss[index(pc)] += k; }
+  long count(long pc) { return get(pc, PERF_EXECUTED); }
+  long cycle(long pc) { return get(pc, PERF_CYCLES); }
+  long imiss(long pc) { return get(pc, PERF_IMISS); }
+  long dmiss(long pc) { return get(pc, PERF_DMISS); }
+  long cmiss(long pc) { return get(pc, PERF_CMISS); }
+  long bmiss(long pc) { return get(pc, PERF_BMISS); }
+  long tmiss(long pc) { return get(pc, PERF_TMISS); }
+  void inc_count( long pc, long k =1) { inc(pc, PERF_EXECUTED, k); }
+  void inc_cycle( long pc, long k =1) { inc(pc, PERF_CYCLES, k); }
+  void inc_imiss( long pc, long k =1) { inc(pc, PERF_IMISS, k); }
+  void inc_dmiss( long pc, long k =1) { inc(pc, PERF_DMISS, k); }
+  void inc_cmiss( long pc, long k =1) { inc(pc, PERF_CMISS, k); }
+  void inc_bmiss( long pc, long k =1) { inc(pc, PERF_BMISS, k); }
+  void inc_tmiss( long pc, long k =1) { inc(pc, PERF_TMISS, k); }
+  // Counts may instead accumulate privately and be added to the
+  // segment by publish(), e.g. at a block exit once stale(), so the hot
+  // path does not write shared volatile memory and readers always see
+  // a consistent state.  The private table is fixed size, independent
+  // of text; an instruction whose entry is taken by another adds that
+  // one's counts to the segment first.
+  void batch();
+  void publish();
+  bool stale() { return _batched >= PERF_BATCH; }
+  long published() { return _published; }
+  void add_count(long pc, long k =1) { add(pc, PERF_EXECUTED, k); _batched += k; }
+  void add_cycle(long pc, long k =1) { add(pc, PERF_CYCLES, k); }
+  void add_imiss(long pc, long k =1) { add(pc, PERF_IMISS, k); }
+  void add_dmiss(long pc, long k =1) { add(pc, PERF_DMISS, k); }
+  void add_cmiss(long pc, long k =1) { add(pc, PERF_CMISS, k); }
+  void add_bmiss(long pc, long k =1) { add(pc, PERF_BMISS, k); }
+  void add_tmiss(long pc, long k =1) { add(pc, PERF_TMISS, k); }
+  // Readers: accessors above read the live segment until the first
+  // snapshot(), then the latest one.  prior() is a counter of the same
+  // instruction one snapshot earlier, for exact deltas.
+  void snapshot();
+  long prior(long pc, int f) { return _snap[1] && _off[f] >= 0 ? _snap[1][index(pc)+_off[f]] : 0; }
+  // Interval samples: the core appends, readers copy up to max of the
+  // newest, oldest first, and get back how many.
+  void record(const interval_t* r);
+  long intervals(interval_t* buf, long max);
 };
+
+inline long* perf_t::pending(long pc)
+{
+  long i = _map[(pc - _base) >> 1];
+  long e = i & (PERF_PENDING-1);
+  long* p = &_pending[e*(_width+1)];
+  if (p[0] != i+1) {
+    if (p[0])
+      evict(p);
+    else
+      _dirty[_ndirty++] = e;
+    p[0] = i+1;
+  }
+  return p+1;
+}
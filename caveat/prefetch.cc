@@ -0,0 +1,164 @@
+/*
+  Copyright (c) 2021 Peter Hsu.  All Rights Reserved.  See LICENCE file for details.
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "options.h"
+#include "uspike.h"
+#include "prefetch.h"
+
+static const char* kind_name[] = { "next-line", "stride", "stream" };
+
+// spec is kind[:degree[:distance]]
+
+prefetch_t::prefetch_t(const char* spec, int lin)
+{
+  char name[32];
+  int deg = 1, dist = 1;
+  int n = sscanf(spec, "%31[a-z]:%d:%d", name, &deg, &dist);
+  quitif(n < 1, "prefetcher %s not kind[:degree[:distance]]", spec);
+  if      (strcmp(name, "next")   == 0)  kind = PF_NEXT;
+  else if (strcmp(name, "stride") == 0)  kind = PF_STRIDE;
+  else if (strcmp(name, "stream") == 0)  kind = PF_STREAM;
+  else
+    quitif(1, "prefetcher %s not next, stride or stream", name);
+  quitif(deg < 1 || deg > PF_MAX_DEGREE, "prefetch degree must be 1..%d", PF_MAX_DEGREE);
+  quitif(dist < 1, "prefetch distance must be positive");
+  degree = deg;
+  distance = dist;
+  lg_line = lin;
+  table = new stride_entry_t[PF_TABLE];
+  memset(table, 0, PF_TABLE*sizeof(stride_entry_t));
+  streams = new stream_entry_t[PF_STREAMS];
+  memset(streams, 0, PF_STREAMS*sizeof(stream_entry_t));
+  inflight = new inflight_t[PF_INFLIGHT];
+  memset(inflight, 0, PF_INFLIGHT*sizeof(inflight_t));
+  now = 0;
+  _issued = _late = _late_cycles = 0;
+}
+
+int prefetch_t::stride_lines(long a, long pc, long* lines)
+{
+  stride_entry_t* e = &table[(pc>>1) & (PF_TABLE-1)];
+  if (e->pc != pc) {
+    e->pc = pc;
+    e->last = a;
+    e->stride = 0;
+    e->confidence = 0;
+    return 0;
+  }
+  long s = a - e->last;
+  e->last = a;
+  if (s == 0)
+    return 0;
+  if (s != e->stride) {
+    e->stride = s;
+    e->confidence = 0;
+    return 0;
+  }
+  if (e->confidence < 3)
+    e->confidence++;
+  if (e->confidence < 2)
+    return 0;
+  int n = 0;
+  long prev = a >> lg_line;
+  for (int k=0; k<degree; k++) {
+    long line = (a + s*(distance+k)) >> lg_line;
+    if (line != prev)		// small strides stay in line
+      lines[n++] = line;
+    prev = line;
+  }
+  return n;
+}
+
+int prefetch_t::stream_lines(long line, long* lines)
+{
+  now++;
+  stream_entry_t* lru = &streams[0];
+  for (int k=0; k<PF_STREAMS; k++) {
+    stream_entry_t* s = &streams[k];
+    long d = line - s->last;
+    if (s->used && d != 0 && d >= -PF_WINDOW && d <= PF_WINDOW) {
+      long dir = d > 0 ? 1 : -1;
+      if (s->dir == dir)
+	s->confidence += (s->confidence < 3);
+      else {
+	s->dir = dir;
+	s->confidence = 0;
+      }
+      s->last = line;
+      s->used = now;
+      if (s->confidence < 1)
+	return 0;
+      for (int j=0; j<degree; j++)
+	lines[j] = line + dir*(distance+j);
+      return degree;
+    }
+    if (s->used < lru->used)
+      lru = s;
+  }
+  lru->last = line;
+  lru->dir = 0;
+  lru->confidence = 0;
+  lru->used = now;
+  return 0;
+}
+
+// Trigger is a demand miss or first hit on a prefetched line.  Stride
+// prefetchers train on every access, the others only on triggers.
+// Lines are returned as line-aligned addresses.
+
+int prefetch_t::train(long a, long pc, bool trigger, long* lines)
+{
+  int n = 0;
+  switch (kind) {
+  case PF_NEXT:
+    if (trigger)
+      for (; n<degree; n++)
+	lines[n] = (a >> lg_line) + distance + n;
+    break;
+  case PF_STRIDE:
+    n = stride_lines(a, pc, lines);
+    break;
+  case PF_STREAM:
+    if (trigger)
+      n = stream_lines(a >> lg_line, lines);
+    break;
+  }
+  for (int k=0; k<n; k++)
+    lines[k] <<= lg_line;
+  return n;
+}
+
+void prefetch_t::issued(long a, long ready)
+{
+  long line = a >> lg_line;
+  inflight_t* f = &inflight[line & (PF_INFLIGHT-1)];
+  f->line = line;
+  f->ready = ready;
+  _issued++;
+}
+
+long prefetch_t::late(long a, long cycle)
+{
+  long line = a >> lg_line;
+  inflight_t* f = &inflight[line & (PF_INFLIGHT-1)];
+  if (f->line != line || f->ready <= cycle)
+    return 0;
+  long wait = f->ready - cycle;
+  f->line = 0;
+  _late++;
+  _late_cycles += wait;
+  return wait;
+}
+
+void prefetch_t::print(FILE* f)
+{
+  fprintf(f, "  %s prefetcher degree %d distance %ld\n", kind_name[kind], degree, distance);
+  fprintf(f, "  %ld prefetches issued\n", _issued);
+  fprintf(f, "  %ld late (%5.3f%%), %ld cycles waiting\n", _late, 100.0*_late/_issued, _late_cycles);
+}
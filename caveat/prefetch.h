@@ -0,0 +1,69 @@
+/*
+  Copyright (c) 2021 Peter Hsu.  All Rights Reserved.  See LICENCE file for details.
+*/
+
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+// Hardware prefetcher attached to one cache_t.  It sees every demand
+// access to that cache and proposes lines to fill:
+//   next    lines following a miss (or first hit on a prefetched line)
+//   stride  per-PC constant stride, once seen twice in a row
+//   stream  ascending or descending sequences of misses
+// Degree is lines issued per trigger, distance how far ahead the first
+// one is.  The owner fills proposed lines and reports when each will
+// arrive, so a demand hit on a line still in flight is counted late and
+// waits for the remainder.  Useful and polluting counts are kept by
+// cache_t, which knows when a prefetched line is first referenced or
+// evicted unreferenced.
+
+#define PF_NEXT    0
+#define PF_STRIDE  1
+#define PF_STREAM  2
+
+#define PF_MAX_DEGREE  16
+#define PF_TABLE       256	// stride entries, indexed by PC
+#define PF_STREAMS     16
+#define PF_WINDOW      4	// lines a stream miss may skip
+#define PF_INFLIGHT    256	// recent prefetches, indexed by line
+
+struct stride_entry_t {
+  long pc;
+  long last;			// address
+  long stride;
+  int confidence;
+};
+
+struct stream_entry_t {
+  long last;			// line number
+  long dir;			// +1, -1 or 0 if not yet known
+  int confidence;
+  long used;			// for replacement
+};
+
+struct inflight_t {
+  long line;
+  long ready;			// cycle fill completes
+};
+
+class prefetch_t {
+  int kind;
+  int degree;
+  long distance;
+  int lg_line;
+  stride_entry_t* table;
+  stream_entry_t* streams;
+  inflight_t* inflight;
+  long now;			// stream replacement clock
+  long _issued, _late, _late_cycles;
+  int stride_lines(long a, long pc, long* lines);
+  int stream_lines(long line, long* lines);
+public:
+  prefetch_t(const char* spec, int lg_line);
+  int train(long a, long pc, bool trigger, long* lines); // returns number of lines
+  void issued(long a, long ready);
+  long late(long a, long cycle);	// cycles until in-flight line arrives
+  void print(FILE* f =stderr);
+};
+
+#endif
@@ -0,0 +1,75 @@
+/*
+  Copyright (c) 2021 Peter Hsu.  All Rights Reserved.  See LICENCE file for details.
+*/
+
+#include <unistd.h>
+#include <stdint.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "mmu.h"
+#include "ring.h"
+
+#define futex(a, b, c)  syscall(SYS_futex, a, b, c, 0, 0, 0)
+
+ring_t::ring_t(int lg_size)
+{
+  mask = (1L<<lg_size) - 1;
+  buf = new event_t[mask+1];
+  memset(buf, 0, (mask+1)*sizeof(event_t));
+  head = next_head = 0;
+  tail = seen_tail = 0;
+  sleeping = 0;
+}
+
+void ring_t::publish()
+{
+  __atomic_store_n(&head, next_head, __ATOMIC_RELEASE);
+  __sync_synchronize();		// order against reading sleeping
+  if (sleeping) {
+    sleeping = 0;
+    futex(&sleeping, FUTEX_WAKE, 1);
+  }
+}
+
+void ring_t::full()
+{
+  publish();
+  for (long spin=0; next_head - (seen_tail = __atomic_load_n(&tail, __ATOMIC_ACQUIRE)) > mask; spin++)
+    if (spin > RING_SPIN)
+      sched_yield();
+}
+
+void ring_t::drain()
+{
+  publish();
+  for (long spin=0; __atomic_load_n(&tail, __ATOMIC_ACQUIRE) != next_head; spin++)
+    if (spin > RING_SPIN)
+      sched_yield();
+  seen_tail = next_head;
+}
+
+void ring_t::settle()
+{
+  long h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+  for (long spin=0; __atomic_load_n(&tail, __ATOMIC_ACQUIRE) < h; spin++)
+    if (spin > RING_SPIN)
+      sched_yield();
+}
+
+long ring_t::wait()
+{
+  long n;
+  for (long spin=0; (n = __atomic_load_n(&head, __ATOMIC_ACQUIRE) - tail) == 0; spin++) {
+    if (spin > RING_SPIN) {
+      sleeping = 1;
+      __sync_synchronize();	// order against reading head
+      if (__atomic_load_n(&head, __ATOMIC_ACQUIRE) == tail)
+	futex(&sleeping, FUTEX_WAIT, 1);
+      spin = 0;
+    }
+  }
+  return n;
+}
@@ -0,0 +1,77 @@
+/*
+  Copyright (c) 2021 Peter Hsu.  All Rights Reserved.  See LICENCE file for details.
+*/
+
+#ifndef RING_H
+#define RING_H
+
+// Decoupled timing.  The interpreter thread only records what each
+// instruction did into a single-producer single-consumer ring; a host
+// thread per core replays the records through the timing model.  The
+// producer publishes its index every RING_BATCH records, and before
+// waiting, so the shared line is not written on every record.  An idle
+// consumer sleeps in futex after RING_SPIN empty polls.
+
+#define EV_INSN    0
+#define EV_LOAD    1
+#define EV_STORE   2
+#define EV_AMO     3
+#define EV_BRANCH  4		// addr is taken
+#define EV_JUMP    5		// addr is npc
+#define EV_SHIFT   60		// kind above user addresses in pc field
+
+struct event_t {
+  long pc;			// kind<<EV_SHIFT | pc
+  long addr;
+};
+
+#define RING_BATCH  64
+#define RING_SPIN   1000
+
+class ring_t {
+  event_t* buf;
+  long mask;
+  volatile long head __attribute__ ((aligned(64))); // published by producer
+  long next_head;		// producer private
+  long seen_tail;
+  volatile long tail __attribute__ ((aligned(64))); // advanced by consumer
+  volatile int sleeping;
+  void full();
+public:
+  ring_t(int lg_size);
+  void push(long kind, long pc, long addr);
+  void publish();
+  void drain();			// producer waits until all records replayed
+  void settle();		// any thread waits until published records replayed
+  long wait();			// consumer, returns number available
+  event_t* at(long k) { return &buf[(tail+k) & mask]; }
+  void consume(long n) { __atomic_store_n(&tail, tail+n, __ATOMIC_RELEASE); }
+};
+
+inline void ring_t::push(long kind, long pc, long addr)
+{
+  if (next_head - seen_tail > mask)
+    full();
+  event_t* e = &buf[next_head & mask];
+  e->pc = kind<<EV_SHIFT | pc;
+  e->addr = addr;
+  if ((++next_head & (RING_BATCH-1)) == 0)
+    publish();
+}
+
+// Memory model of the interpreter thread in decoupled mode.
+
+class recorder_t : public mmu_t {
+  ring_t ring;
+public:
+  recorder_t(int lg_size) : ring(lg_size) { }
+  ring_t* events() { return &ring; }
+  void insn_model(long pc) { ring.push(EV_INSN, pc, 0); }
+  long jump_model(long npc, long pc) { ring.push(EV_JUMP, pc, npc); return npc; }
+  bool branch_model(bool taken, long pc) { ring.push(EV_BRANCH, pc, taken); return taken; }
+  long load_model( long a, long pc) { ring.push(EV_LOAD,  pc, a); return a; }
+  long store_model(long a, long pc) { ring.push(EV_STORE, pc, a); return a; }
+  void amo_model(  long a, long pc) { ring.push(EV_AMO,   pc, a); }
+};
+
+#endif
@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <signal.h>
 #include <limits.h>
+#include <pthread.h>
 #include <sys/syscall.h>
 #include <linux/futex.h>
 
@@ -11,27 +12,114 @@
 #include "instructions.h"
 #include "mmu.h"
 #include "hart.h"
+#include "interpreter.h"
 #include "cache.h"
+#include "coherence.h"
+#include "barrier.h"
+#include "bpred.h"
+#include "ooo.h"
+#include "ring.h"
+#include "sweep.h"
+#include "prefetch.h"
+#include "dram.h"
 #include "perf.h"
 
 using namespace std;
 void* operator new(size_t size);
 void operator delete(void*) noexcept;
 
+option<>    conf_model("model",	"inorder",	"Core timing model inorder or ooo");
+option<int> conf_width("width",	4,		"Out-of-order issue and retire width");
+option<int> conf_rob("rob",	128,		"Out-of-order reorder buffer entries");
+option<int> conf_lsq("lsq",	48,		"Out-of-order load/store queue entries");
+option<int> conf_loadlat("loadlat", 3,		"Out-of-order load-to-use latency");
+option<int> conf_mullat("mullat", 3,		"Out-of-order integer multiply latency");
+option<int> conf_divlat("divlat", 20,		"Out-of-order integer divide latency");
+option<int> conf_fpulat("fpulat", 4,		"Out-of-order floating point latency");
+option<int> conf_fdivlat("fdivlat", 15,		"Out-of-order floating divide and sqrt latency");
+
 option<long> conf_Jump("jump",	2,		"Taken branch pipeline flush cycles");
+option<>    conf_bpred("bpred",	"none",		"Branch predictor none, bimodal, gshare or tage");
+option<int> conf_bpsize("bpsize", 12,		"Branch predictor log-base-2 table entries");
+option<int> conf_btb("btb",	10,		"Branch target buffer log-base-2 entries");
+option<int> conf_ras("ras",	16,		"Return address stack entries");
+option<long> conf_Mispredict("mispredict", 12,	"Branch mispredict penalty");
+
+option<>    conf_Iprefetch("iprefetch", "none",	"Instruction cache prefetcher none, next, stride or stream[:degree[:distance]]");
+option<>    conf_Dprefetch("dprefetch", "none",	"Data cache prefetcher none, next, stride or stream[:degree[:distance]]");
+option<>    conf_L2prefetch("l2prefetch", "none", "L2 cache prefetcher none, next, stride or stream[:degree[:distance]]");
 
 option<int> conf_Imiss("imiss",	15,		"Instruction cache miss penalty");
 option<int> conf_Iways("iways", 4,		"Instruction cache number of ways associativity");
 option<int> conf_Iline("iline",	6,		"Instruction cache log-base-2 line size");
 option<int> conf_Irows("irows",	6,		"Instruction cache log-base-2 number of rows");
+option<>    conf_Ipolicy("ipolicy", "lru",	"Instruction cache replacement lru, plru or rrip");
 
 option<int> conf_Dmiss("dmiss",	15,		"Data cache miss penalty");
 option<int> conf_Dways("dways", 4,		"Data cache number of ways associativity");
 option<int> conf_Dline("dline",	6,		"Data cache log-base-2 line size");
 option<int> conf_Drows("drows",	6,		"Data cache log-base-2 number of rows");
+option<>    conf_Dpolicy("dpolicy", "lru",	"Data cache replacement lru, plru or rrip");
+
+option<int> conf_L2miss("l2miss", 30,		"L2 cache miss penalty");
+option<int> conf_L2ways("l2ways", 0,		"L2 cache number of ways associativity, 0=none");
+option<int> conf_L2line("l2line", 6,		"L2 cache log-base-2 line size");
+option<int> conf_L2rows("l2rows", 9,		"L2 cache log-base-2 number of rows");
+option<>    conf_L2policy("l2policy", "lru",	"L2 cache replacement lru, plru or rrip");
+
+option<int> conf_LLCmiss("llcmiss", 100,	"Shared last level cache miss penalty");
+option<int> conf_LLCways("llcways", 0,		"Shared LLC number of ways associativity, 0=none");
+option<int> conf_LLCline("llcline", 6,		"Shared LLC log-base-2 line size");
+option<int> conf_LLCrows("llcrows", 13,		"Shared LLC log-base-2 number of rows");
+option<int> conf_LLCbanks("llcbanks", 3,	"Shared LLC log-base-2 number of banks");
+option<>    conf_LLCpolicy("llcpolicy", "lru",	"Shared LLC replacement lru, plru or rrip");
+
+option<bool> conf_dram("dram",	false, true,	"Model DRAM behind last cache level");
+option<int> conf_channels("channels", 1,	"DRAM log-base-2 number of channels");
+option<int> conf_drambanks("drambanks", 4,	"DRAM log-base-2 banks per channel");
+option<int> conf_dramrow("dramrow", 13,		"DRAM log-base-2 row buffer bytes");
+option<int> conf_tCAS("tcas",	40,		"DRAM column access cycles");
+option<int> conf_tRCD("trcd",	40,		"DRAM row activate cycles");
+option<int> conf_tRP("trp",	40,		"DRAM precharge cycles");
+option<int> conf_tBURST("tburst", 8,		"DRAM data bus cycles per line");
+
+option<bool> conf_tlb("tlb",	false, true,	"Model TLBs and page table walks");
+option<int> conf_lgpage("lgpage", 12,		"Log-base-2 page size, 12=4KB 21=2MB");
+option<int> conf_TLBmiss("tlbmiss", 7,		"L1 TLB miss penalty (L2 TLB hit)");
+option<int> conf_ITLBways("itlbways", 4,	"Instruction TLB number of ways associativity");
+option<int> conf_ITLBrows("itlbrows", 3,	"Instruction TLB log-base-2 number of rows");
+option<int> conf_DTLBways("dtlbways", 4,	"Data TLB number of ways associativity");
+option<int> conf_DTLBrows("dtlbrows", 4,	"Data TLB log-base-2 number of rows");
+option<int> conf_walk("walk",	20,		"Page table walk cycles, plus PTE cache misses");
+option<int> conf_L2TLBways("l2tlbways", 8,	"L2 TLB number of ways associativity");
+option<int> conf_L2TLBrows("l2tlbrows", 8,	"L2 TLB log-base-2 number of rows");
+
+option<bool> conf_mesi("mesi",	false, true,	"MESI coherence between data caches");
+option<int> conf_c2c("c2c",	40,		"Cache-to-cache transfer penalty");
+option<int> conf_dirsets("dirsets", 16,		"Coherence directory log-base-2 number of sets");
+
+option<long> conf_quantum("quantum", 1000,	"Cycles between core time synchronization, 0=never");
+
+option<>    conf_sweep("sweep",	0, "caveat.sweep", "Write data cache size sweep to file");
+option<>    conf_sweepline("sweepline", "5:7",	"Sweep log-base-2 line sizes lo:hi");
+option<>    conf_sweeprows("sweeprows", "4:12",	"Sweep log-base-2 number of rows lo:hi");
+option<int> conf_sweepways("sweepways", 16,	"Sweep maximum associativity");
+
+option<bool> conf_decouple("decouple", false, true, "Run timing model in separate host thread per core");
+option<int> conf_ring("ring",	16,		"Decoupled event ring log-base-2 entries");
+
 option<int> conf_cores("cores",	8,		"Maximum number of cores");
 
 option<>    conf_perf( "perf",	"caveat",	"Name of shared memory segment");
+option<long> conf_interval("interval", 10,	"Millions of instructions between perf samples, 0=never");
+
+static shared_cache_t* llc;	// NULL if none
+static dram_t* dram;		// NULL if memory latency is last level penalty
+static directory_t* dir;	// NULL if not coherent
+static barrier_t* barrier;	// NULL if cores not synchronized
+
+#define INVAL_HISTORY  256	// recently invalidated lines, to spot coherence misses
+#define PAGE_TABLE  (1L<<56)	// where page walks read PTEs, level<<48 apart
 
 class mem_t : public mmu_t, public perf_t {
 public:
@@ -39,144 +127,642 @@ public:
   mem_t(long n);
   void insn_model(long pc);
   long jump_model(long npc, long pc);
+  bool branch_model(bool taken, long pc);
   long load_model( long a,  long pc);
   long store_model(long a,  long pc);
   void amo_model(  long a,  long pc);
+  void flush_tlb();
   cache_t* dcache() { return &dc; }
   long clock() { return local_time; }
   void print();
+  void write_sweep(FILE* f) { if (sw) sw->write(f); }
+  void set_clock(long t);
+  void join_quantum();
+  void leave_quantum();
+  long syscalls;
+  void flush_perf(bool final =false);
 private:
+  long next_sync;		// end of quantum
+  interval_t last_sample;	// totals at previous sample
+  long next_sample;		// instructions
   cache_t ic;
   cache_t dc;
+  cache_t* l2;			// private, NULL if none
+  prefetch_t* ipf;		// NULL if none
+  prefetch_t* dpf;
+  prefetch_t* l2pf;
+  cache_t* itlb;		// NULL if TLBs not modeled
+  cache_t* dtlb;
+  cache_t* l2tlb;		// shared by itlb and dtlb
+  long last_ipage, last_dpage;	// translated by most recent lookup
+  int walk_levels;
+  long _walks;
+  bpred_t* bp;			// NULL for flat conf_Jump penalty
+  ooo_t* ooo;			// NULL for single-issue in-order
+  sweep_t* sw;			// NULL unless sweeping
+  long core;			// number in directory
+  long recent_inval[INVAL_HISTORY];
+  long _upgrades, _invalidations, _downgrades, _transfers, _coh_misses;
+  long refill(cache_t* l1, long a);
+  long fetch(long a);
+  long fetch_llc(long a, long cycles);
+  void writeback(cache_t* from, long a);
+  long coherent_refill(long a, long pc, bool write);
+  long prefetch(cache_t* c, prefetch_t* pf, long a, long pc, bool hit);
+  long translate(cache_t* tlb, long* last, long a, long pc);
+  long walk(long a, long pc);
+  long upgrade(long a);
+  void receive();
 };
 
+// Cycles to bring line containing a into L1 after a miss.  Each level
+// that misses adds its own penalty, and with --dram a miss in the last
+// level adds the memory access time, which depends on load.  Dirty
+// victims are written into the next level, which may in turn evict;
+// writebacks cost no cycles but occupy DRAM.
+
+long mem_t::refill(cache_t* l1, long a)
+{
+  if (l1->evicted())
+    writeback(l1, l1->evicted());
+  return l1->penalty() + fetch(a);
+}
+
+long mem_t::fetch(long a)	// beyond L1
+{
+  long cycles = 0;
+  if (l2) {
+    bool hit = l2->lookup(a);
+    if (!hit) {
+      cycles += l2->penalty();
+      if (l2->evicted())
+	writeback(l2, l2->evicted());
+    }
+    if (l2pf)			// L2 sees no PC, so stride is global
+      cycles += prefetch(l2, l2pf, a, 0, hit);
+    if (hit)
+      return cycles;
+  }
+  return fetch_llc(a, cycles);
+}
+
+long mem_t::fetch_llc(long a, long cycles)	// beyond L2, after cycles
+{
+  long ev;
+  if (llc) {
+    if (llc->lookup(a, false, &ev))
+      return cycles;
+    cycles += llc->penalty();
+    if (ev && dram)		// dirty victim of the refill
+      dram->write(ev, local_time+cycles);
+  }
+  if (dram)
+    cycles += dram->read(a, local_time+cycles);
+  return cycles;
+}
+
+void mem_t::writeback(cache_t* from, long a)
+{
+  long ev;
+  if (from != l2 && l2) {
+    if (!l2->lookup(a, true) && l2->evicted())
+      writeback(l2, l2->evicted());
+  }
+  else if (llc) {
+    llc->lookup(a, true, &ev);	// LLC victims go to memory
+    if (ev && dram)
+      dram->write(ev, local_time);
+  }
+  else if (dram)
+    dram->write(a, local_time);
+}
+
+// Train prefetcher pf of cache c on a demand access, then fill the
+// lines it proposes through the rest of the hierarchy.  Fills do not
+// stall the core, but a demand hit on a line still in flight waits for
+// the remainder, which is returned.  Call after any use of c's last
+// lookup state, which prefetch fills overwrite.
+
+long mem_t::prefetch(cache_t* c, prefetch_t* pf, long a, long pc, bool hit)
+{
+  bool pfhit = hit && c->prefetched();
+  long wait = pfhit ? pf->late(a, local_time) : 0;
+  long lines[PF_MAX_DEGREE];
+  int n = pf->train(a, pc, !hit || pfhit, lines);
+  for (int k=0; k<n; k++) {
+    long line = lines[k];
+    if (line <= 0 || c->prefetch(line))
+      continue;
+    if (c->evicted())
+      writeback(c, c->evicted());
+    long cycles = c->penalty();
+    if (c == l2)
+      cycles = fetch_llc(line, cycles);
+    else if (c == &dc && dir) {
+      if (dc.victim())
+	dir->evict(core, dc.victim());
+      int flags = dir->read(core, line);
+      dc.set_exclusive(flags & COH_EXCL);
+      cycles += flags & COH_C2C ? conf_c2c : fetch(line);
+    }
+    else
+      cycles += fetch(line);
+    pf->issued(line, local_time + wait + cycles);
+  }
+  return wait;
+}
+
+// Data cache miss under MESI.  A line modified or exclusive in another
+// core comes directly from that cache, otherwise from the next level.
+
+long mem_t::coherent_refill(long a, long pc, bool write)
+{
+  if (dc.victim())
+    dir->evict(core, dc.victim());
+  if (dc.evicted())
+    writeback(&dc, dc.evicted());
+  long line = a >> dc.lg_linesize();
+  long* h = &recent_inval[line & (INVAL_HISTORY-1)];
+  if (*h == line) {
+    add_cmiss(pc);
+    _coh_misses++;
+    *h = 0;
+  }
+  int flags = write ? dir->write(core, a) : dir->read(core, a);
+  dc.set_exclusive(flags & COH_EXCL);
+  if (flags & COH_C2C) {
+    _transfers++;
+    return dc.penalty() + conf_c2c;
+  }
+  return dc.penalty() + fetch(a);
+}
+
+long mem_t::upgrade(long a)	// store hit on shared line
+{
+  _upgrades++;
+  int flags = dir->write(core, a);
+  dc.set_exclusive(true);
+  return dc.penalty() + (flags & COH_C2C ? conf_c2c : 0);
+}
+
+// Cycles to translate address a, 0 on L1 TLB hit.  Another reference
+// to the page just translated cannot change TLB state, so is skipped.
+
+inline long mem_t::translate(cache_t* tlb, long* last, long a, long pc)
+{
+  long page = a >> conf_lgpage;
+  if (page == *last)
+    return 0;
+  *last = page;
+  if (tlb->lookup(a))
+    return 0;
+  add_tmiss(pc);
+  return tlb->penalty() + (l2tlb->lookup(a) ? 0 : walk(a, pc));
+}
+
+// L2 TLB miss reads one PTE per level through the data cache
+// hierarchy.  Each level of the table is a linear array indexed by
+// virtual page number bits, so neighboring pages share PTE lines.
+
+long mem_t::walk(long a, long pc)
+{
+  _walks++;
+  long cycles = l2tlb->penalty();
+  for (int level=0; level<walk_levels; level++) {
+    long pte = PAGE_TABLE + ((long)level<<48) + (a >> (conf_lgpage + 9*(walk_levels-1-level)) << 3);
+    if (!dc.lookup(pte))
+      cycles += dir ? coherent_refill(pte, pc, false) : refill(&dc, pte);
+  }
+  return cycles;
+}
+
+void mem_t::flush_tlb()
+{
+  if (!itlb)
+    return;
+  itlb->flush();
+  dtlb->flush();
+  l2tlb->flush();
+  last_ipage = last_dpage = -1;
+}
+
+void mem_t::receive()
+{
+  coh_msg_t* m = dir->receive(core);
+  while (m) {
+    if (m->kind == MSG_INVALIDATE) {
+      dc.invalidate(m->addr);	// dirty data went to requester
+      if (l2)
+	l2->invalidate(m->addr);
+      long line = m->addr >> dc.lg_linesize();
+      recent_inval[line & (INVAL_HISTORY-1)] = line;
+      _invalidations++;
+    }
+    else {
+      if (dc.downgrade(m->addr))
+	writeback(&dc, m->addr);
+      _downgrades++;
+    }
+    coh_msg_t* next = m->next;
+    delete m;
+    m = next;
+  }
+}
+
+// The out-of-order model charges each instruction the cycles between
+// its retirement and that of its predecessor.
+
 inline void mem_t::insn_model(long pc)
 {
-  if (!ic.lookup(pc)) {
-    local_time += ic.penalty();
-    inc_imiss(pc);
-    inc_cycle(pc, ic.penalty());
+  long penalty = itlb ? translate(itlb, &last_ipage, pc, pc) : 0;
+  bool hit = ic.lookup(pc);
+  if (!hit) {
+    penalty += refill(&ic, pc);
+    add_imiss(pc);
+  }
+  if (ipf)
+    penalty += prefetch(&ic, ipf, pc, pc, hit);
+  if (ooo) {
+    long prev = ooo->pc();
+    long t = ooo->insn(pc, penalty);
+    if (t > local_time) {
+      add_cycle(prev, t-local_time);
+      local_time = t;
+    }
+    add_count(pc);
+  }
+  else {
+    add_count(pc);
+    add_cycle(pc, 1+penalty);
+    local_time += 1+penalty;
+  }
+  if (local_time >= next_sync) {
+    barrier->wait();
+    next_sync = barrier->time();
   }
-  inc_count(pc);
-  inc_cycle(pc);
-  local_time += 1;
 }
 
 inline long mem_t::jump_model(long npc, long pc)
 {
-  local_time += conf_Jump;
-  inc_cycle(npc, conf_Jump);
+  if (stale())			// taken jump ends a block
+    flush_perf();
+  int outcome = bp ? bp->jump(npc, pc) : JUMP_REDIRECT;
+  switch (outcome) {
+  case JUMP_REDIRECT:
+    if (ooo)
+      ooo->redirect(conf_Jump);
+    else {
+      local_time += conf_Jump;
+      add_cycle(npc, conf_Jump);
+    }
+    break;
+  case JUMP_MISPREDICT:
+    if (ooo)
+      ooo->mispredict(conf_Mispredict);
+    else {
+      local_time += conf_Mispredict;
+      add_cycle(pc, conf_Mispredict);
+    }
+    add_bmiss(pc);
+    break;
+  }
   return npc;
 }
 
+inline bool mem_t::branch_model(bool taken, long pc)
+{
+  if (taken && stale())
+    flush_perf();
+  if (bp && bp->branch(taken, pc)) {
+    if (ooo)
+      ooo->mispredict(conf_Mispredict);
+    else {
+      local_time += conf_Mispredict;
+      add_cycle(pc, conf_Mispredict);
+    }
+    add_bmiss(pc);
+  }
+  return taken;
+}
+
 inline long mem_t::load_model(long a, long pc)
 {
-  if (!dc.lookup(a)) {
-    inc_dmiss(pc);
-    local_time += dc.penalty();
-    inc_cycle(pc, dc.penalty());
+  if (dir && dir->pending(core))
+    receive();
+  if (sw)
+    sw->reference(a, pc);
+  long penalty = dtlb ? translate(dtlb, &last_dpage, a, pc) : 0;
+  bool hit = dc.lookup(a);
+  if (!hit) {
+    penalty += dir ? coherent_refill(a, pc, false) : refill(&dc, a);
+    add_dmiss(pc);
+  }
+  if (dpf)
+    penalty += prefetch(&dc, dpf, a, pc, hit);
+  if (ooo)
+    ooo->load(penalty);
+  else if (penalty) {
+    local_time += penalty;
+    add_cycle(pc, penalty);
   }
   return a;
 }
 
 inline long mem_t::store_model(long a, long pc)
 {
-  if (!dc.lookup(a, true)) {
-    inc_dmiss(pc);
-    local_time += dc.penalty();
-    inc_cycle(pc, dc.penalty());
+  if (dir && dir->pending(core))
+    receive();
+  if (sw)
+    sw->reference(a, pc);
+  long penalty = dtlb ? translate(dtlb, &last_dpage, a, pc) : 0;
+  bool hit = dc.lookup(a, true);
+  if (!hit) {
+    penalty += dir ? coherent_refill(a, pc, true) : refill(&dc, a);
+    add_dmiss(pc);
+  }
+  else if (dir && !dc.exclusive())
+    penalty += upgrade(a);
+  if (dpf)
+    penalty += prefetch(&dc, dpf, a, pc, hit);
+  if (ooo)
+    ooo->store(penalty);
+  else if (penalty) {
+    local_time += penalty;
+    add_cycle(pc, penalty);
   }
   return a;
 }
 
 inline void mem_t::amo_model(long a, long pc)
 {
-  if (!dc.lookup(a, true)) {
-    inc_dmiss(pc);
-    local_time += dc.penalty();
-    inc_cycle(pc, dc.penalty());
+  if (dir && dir->pending(core))
+    receive();
+  if (sw)
+    sw->reference(a, pc);
+  long penalty = dtlb ? translate(dtlb, &last_dpage, a, pc) : 0;
+  bool hit = dc.lookup(a, true);
+  if (!hit) {
+    penalty += dir ? coherent_refill(a, pc, true) : refill(&dc, a);
+    add_dmiss(pc);
+  }
+  else if (dir && !dc.exclusive())
+    penalty += upgrade(a);
+  if (dpf)
+    penalty += prefetch(&dc, dpf, a, pc, hit);
+  if (ooo)
+    ooo->load(penalty);
+  else if (penalty) {
+    local_time += penalty;
+    add_cycle(pc, penalty);
   }
 }
 
-class core_t : public mem_t, public hart_t {
-  static volatile long global_time;
+class core_t : public hart_t, public mem_t {	// hart_t first so number() is valid
+  ring_t* ring;			// NULL unless decoupled
+  void start_timing();
+  static void* timing_thread(void* arg);
 public:
   core_t();
   core_t(core_t* p);
   core_t* newcore() { return new core_t(this); }
+  bool interpreter(long how_many);
   void proxy_syscall(long sysnum);
+  void finish();
   
   static core_t* list() { return (core_t*)hart_t::list(); }
   core_t* next() { return (core_t*)hart_t::next(); }
   mem_t* mem() { return static_cast<mem_t*>(this); }
   cache_t* dcache() { return mem()->dcache(); }
 
-  long system_clock() { return global_time; }
+  long system_clock() { return barrier ? barrier->start() : 0; }
   long local_clock() { return mem()->clock(); }
-  void update_time();
 };
 
-volatile long core_t::global_time;
-
 mem_t::mem_t(long n)
   : perf_t(n),
-    ic("Instruction", conf_Imiss, conf_Iways, conf_Iline, conf_Irows, false),
-    dc("Data",        conf_Dmiss, conf_Dways, conf_Dline, conf_Drows, true)
+    ic("Instruction", conf_Imiss, conf_Iways, conf_Iline, conf_Irows, false, conf_Ipolicy),
+    dc("Data",        conf_Dmiss, conf_Dways, conf_Dline, conf_Drows, true,  conf_Dpolicy)
 		 
 {
+  batch();
+  syscalls = 0;
+  memset(&last_sample, 0, sizeof last_sample);
+  next_sample = conf_interval > 0 ? conf_interval*1000000 : LONG_MAX;
   local_time = 0;
+  core = n;
+  dieif(dir && core>=MAX_COHERENT_CORES, "MESI supports only %d cores", MAX_COHERENT_CORES);
+  memset(recent_inval, 0, sizeof recent_inval);
+  _upgrades = _invalidations = _downgrades = _transfers = _coh_misses = 0;
+  bp = 0;
+  if (strcmp(conf_bpred, "none") != 0)
+    bp = new bpred_t(conf_bpred, conf_bpsize, conf_btb, conf_ras);
+  ooo = 0;
+  if (strcmp(conf_model, "ooo") == 0) {
+    long lat[OOO_CLASSES] = { 1, conf_mullat, conf_divlat, conf_fpulat, conf_fdivlat, conf_loadlat };
+    ooo = new ooo_t(conf_width, conf_rob, conf_lsq, lat);
+  }
+  else
+    quitif(strcmp(conf_model, "inorder") != 0, "core model %s not inorder or ooo", (const char*)conf_model);
+  sw = 0;
+  if (conf_sweep)
+    sw = new sweep_t(conf_sweepline, conf_sweeprows, conf_sweepways);
+  itlb = dtlb = l2tlb = 0;
+  if (conf_tlb) {
+    quitif(conf_lgpage != 12 && conf_lgpage != 21 && conf_lgpage != 30, "page size must be 4KB, 2MB or 1GB");
+    itlb  = new cache_t("Instruction TLB", conf_TLBmiss, conf_ITLBways, conf_lgpage, conf_ITLBrows, false);
+    dtlb  = new cache_t("Data TLB",        conf_TLBmiss, conf_DTLBways, conf_lgpage, conf_DTLBrows, false);
+    l2tlb = new cache_t("L2 TLB",          conf_walk,    conf_L2TLBways, conf_lgpage, conf_L2TLBrows, false);
+  }
+  last_ipage = last_dpage = -1;
+  walk_levels = 4 - (conf_lgpage-12)/9;	// Sv48
+  _walks = 0;
+  l2 = 0;
+  if (conf_L2ways > 0)
+    l2 = new cache_t("L2", conf_L2miss, conf_L2ways, conf_L2line, conf_L2rows, true, conf_L2policy);
+  ipf = strcmp(conf_Iprefetch, "none") ? new prefetch_t(conf_Iprefetch, conf_Iline) : 0;
+  dpf = strcmp(conf_Dprefetch, "none") ? new prefetch_t(conf_Dprefetch, conf_Dline) : 0;
+  l2pf = 0;
+  if (l2 && strcmp(conf_L2prefetch, "none"))
+    l2pf = new prefetch_t(conf_L2prefetch, conf_L2line);
+  next_sync = LONG_MAX;
+}
+
+// Publish counters, and at interval boundaries append a sample of
+// progress since the previous one to the perf segment.  The final
+// flush samples whatever partial interval remains.
+
+void mem_t::flush_perf(bool final)
+{
+  publish();
+  if (final ? published() == last_sample.instructions : published() < next_sample)
+    return;
+  interval_t now, r;
+  now.instructions = published();
+  now.cycles = now.end = local_time;
+  now.imiss = ic.misses();
+  now.dmiss = dc.misses();
+  now.syscalls = syscalls;
+  r.instructions = now.instructions - last_sample.instructions;
+  r.cycles = now.cycles - last_sample.cycles;
+  r.imiss = now.imiss - last_sample.imiss;
+  r.dmiss = now.dmiss - last_sample.dmiss;
+  r.syscalls = now.syscalls - last_sample.syscalls;
+  r.end = now.end;
+  record(&r);
+  last_sample = now;
+  next_sample = now.instructions + conf_interval*1000000;
+}
+
+void mem_t::set_clock(long t)
+{
+  if (published() == 0)		// new core, first interval starts now
+    last_sample.cycles = t;
+  local_time = t;
+  if (ooo)
+    ooo->advance(t);
+}
+
+void mem_t::join_quantum()
+{
+  if (!barrier)
+    return;
+  barrier->join();
+  if (local_time < barrier->start())
+    set_clock(barrier->start()); // time passed while we were away
+  next_sync = barrier->time();
+}
+
+void mem_t::leave_quantum()
+{
+  if (barrier)
+    barrier->leave();
 }
 
 void mem_t::print()
 {
   ic.print();
+  if (ipf)
+    ipf->print();
   dc.print();
+  if (dpf)
+    dpf->print();
+  if (dir) {
+    fprintf(stderr, "  %ld upgrades\n", _upgrades);
+    fprintf(stderr, "  %ld invalidations received\n", _invalidations);
+    fprintf(stderr, "  %ld downgrades received\n", _downgrades);
+    fprintf(stderr, "  %ld cache-to-cache transfers\n", _transfers);
+    fprintf(stderr, "  %ld coherence misses\n", _coh_misses);
+  }
+  if (l2)
+    l2->print();
+  if (l2pf)
+    l2pf->print();
+  if (itlb) {
+    itlb->print();
+    dtlb->print();
+    l2tlb->print();
+    fprintf(stderr, "  %ld page table walks\n", _walks);
+  }
+  if (bp)
+    bp->print();
+  if (ooo)
+    ooo->print();
 }
 
-core_t::core_t() : hart_t(mem()), mem_t(number())
+// In decoupled mode the hart's memory model is a recorder_t feeding
+// events to this core's timing thread, otherwise it is our mem_t.
+
+static mmu_t* model(mem_t* m)
 {
+  return conf_decouple ? new recorder_t(conf_ring) : (mmu_t*)m;
 }
 
-core_t::core_t(core_t* p) : hart_t(p, mem()), mem_t(number())
+// A core joins the quantum on the host thread that will run it: main
+// for the first core, the clone child in thread_interpreter() for the
+// others.  The parent meanwhile waits in proxy_syscall() outside the
+// quantum, so its clock is stable and it cannot hold a quantum open
+// that the child has not joined.  Inherit the parent's clock before
+// joining, so a quantum that ended during clone() moves us forward.
+
+core_t::core_t() : hart_t(model(mem())), mem_t(number())
 {
-  local_time = p->local_time;
+  join_quantum();
+  start_timing();
 }
 
+core_t::core_t(core_t* p) : hart_t(p, model(mem())), mem_t(number())
+{
+  set_clock(p->local_time);
+  join_quantum();
+  start_timing();
+}
 
-#define futex(a, b, c)  syscall(SYS_futex, a, b, c, 0, 0, 0)
+void core_t::start_timing()
+{
+  ring = 0;
+  if (!conf_decouple)
+    return;
+  ring = ((recorder_t*)mmu())->events();
+  pthread_t t;
+  dieif(pthread_create(&t, 0, timing_thread, this), "cannot create timing thread");
+}
 
-#define SYSCALL_OVERHEAD 100
-void core_t::proxy_syscall(long sysnum)
+void* core_t::timing_thread(void* arg)
 {
-  /*
-  update_time();
-  long t = global_time;
-  fprintf(stderr, "local=%ld %ld=global\n", local_time, t);
-  while (t < local_time) {
-    futex((int*)&global_time, FUTEX_WAIT, (int)t);
-    t = global_time;
-    fprintf(stderr, "local=%ld %ld=global\n", local_time, t);
+  core_t* c = (core_t*)arg;
+  mem_t* m = c->mem();
+  ring_t* r = c->ring;
+  while (1) {
+    long n = r->wait();
+    for (long k=0; k<n; k++) {
+      event_t* e = r->at(k);
+      long pc = e->pc & ((1L<<EV_SHIFT)-1);
+      switch (e->pc >> EV_SHIFT) {
+      case EV_INSN:    m->insn_model(pc);		break;
+      case EV_LOAD:    m->load_model(e->addr, pc);	break;
+      case EV_STORE:   m->store_model(e->addr, pc);	break;
+      case EV_AMO:     m->amo_model(e->addr, pc);	break;
+      case EV_BRANCH:  m->branch_model(e->addr, pc);	break;
+      case EV_JUMP:    m->jump_model(e->addr, pc);	break;
+      }
+    }
+    r->consume(n);
   }
-  local_time = LONG_MAX;
-  */
+  return 0;
+}
+
+bool core_t::interpreter(long how_many)
+{
+  if (!ring)
+    return interpret(mem(), how_many);
+  bool stopped = interpret((recorder_t*)mmu(), how_many);
+  ring->publish();
+  return stopped;
+}
+
+
+void core_t::proxy_syscall(long sysnum)
+{
+  if (ring)
+    ring->drain();		// timing catches up before we block or exit
+  syscalls++;
+  flush_perf();
+  leave_quantum();		// others need not wait while we block
   hart_t::proxy_syscall(sysnum);
-  /*
-  global_time += SYSCALL_OVERHEAD;
-  local_time = global_time;
-  update_time();
-  futex((int*)&global_time, FUTEX_WAKE, INT_MAX);
-  */
+  join_quantum();
 }
 
-void core_t::update_time()
+
+// At exit, from whichever core called exit: other cores may still be
+// running, so as with the statistics printed after, their counts are
+// as of now.  Only the events they have already published are waited
+// for, since the rest belong to their interpreter threads.
+
+void core_t::finish()
 {
-  long last_local = LONG_MAX;
-  for (core_t* p=core_t::list(); p; p=p->next()) {
-    if (p->local_time < last_local)
-      last_local = p->local_time;
-  }
-  dieif(last_local<global_time, "local %ld < %ld global", last_local, global_time);
-  global_time = last_local;
+  if (ring)
+    ring->settle();
+  flush_perf(true);
 }
 
 
@@ -186,14 +772,33 @@ void status_report();
 
 void exitfunc()
 {
+  for (core_t* p=core_t::list(); p; p=p->next())
+    p->finish();
   fprintf(stderr, "\n--------\n");
   for (core_t* p=core_t::list(); p; p=p->next()) {
     fprintf(stderr, "Core [%ld] ", p->tid());
     p->mem()->print();
   }
+  if (llc)
+    llc->print();
+  if (dram)
+    dram->print();
+  if (dir)
+    fprintf(stderr, "Directory evictions %ld\n", dir->evictions());
+  if (conf_sweep) {
+    FILE* f = fopen(conf_sweep, "w");
+    dieif(!f, "cannot open %s", (const char*)conf_sweep);
+    for (core_t* p=core_t::list(); p; p=p->next()) {
+      fprintf(f, "# Core [%ld] data cache sweep\n", p->tid());
+      p->mem()->write_sweep(f);
+      fprintf(f, "\n");
+    }
+    fclose(f);
+  }
   fprintf(stderr, "\n");
   status_report();
   fprintf(stderr, "\n");
+  fusion_report();
 }
 
 #ifdef DEBUG
@@ -219,7 +824,24 @@ int main(int argc, const char* argv[], const char* envp[])
     help_exit();
   start_time();
   code.loadelf(argv[0]);
-  perf_t::create(code.base(), code.limit(), conf_cores, conf_perf);
+  long fields = 0;		// counters whose model is on
+  if (conf_mesi)
+    fields |= 1<<PERF_CMISS;
+  if (strcmp(conf_bpred, "none") != 0)
+    fields |= 1<<PERF_BMISS;
+  if (conf_tlb)
+    fields |= 1<<PERF_TMISS;
+  perf_t::create(code.base(), code.limit(), conf_cores, fields, conf_perf);
+  if (conf_LLCways > 0)
+    llc = new shared_cache_t("LLC", conf_LLCmiss, conf_LLCways, conf_LLCline, conf_LLCrows, conf_LLCbanks, conf_LLCpolicy);
+  if (conf_mesi)
+    dir = new directory_t(conf_Dline, conf_dirsets);
+  if (conf_dram) {
+    int lg_line = conf_LLCways > 0 ? conf_LLCline : conf_L2ways > 0 ? conf_L2line : conf_Dline;
+    dram = new dram_t(lg_line, conf_channels, conf_drambanks, conf_dramrow, conf_tCAS, conf_tRCD, conf_tRP, conf_tBURST);
+  }
+  if (conf_quantum > 0)
+    barrier = new barrier_t(conf_quantum);
   for (int i=0; i<perf_t::cores(); i++)
     new perf_t(i);
   long sp = initialize_stack(argc, argv, envp);
@@ -240,7 +862,8 @@ int main(int argc, const char* argv[], const char* envp[])
   while (1) {
     mycpu->interpreter(10000000L);
     double realtime = elapse_time();
-    fprintf(stderr, "\r\33[2K%12ld insns %3.1fs %3.1f MIPS IPC", core_t::total_count(), realtime, core_t::total_count()/1e6/realtime);
+    long total = core_t::total_count();
+    fprintf(stderr, "\r\33[2K%12ld insns %3.1fs %3.1f MIPS IPC", total, realtime, total/1e6/realtime);
     char separator = '=';
     for (core_t* p=core_t::list(); p; p=p->next()) {
       fprintf(stderr, "%c%4.2f", separator, (double)p->executed()/p->local_clock());
@@ -249,47 +872,4 @@ int main(int argc, const char* argv[], const char* envp[])
   }
 }
 
-extern "C" {
-
-#define poolsize  (1<<30)	/* size of simulation memory pool */
-
-static char simpool[poolsize];	/* base of memory pool */
-static volatile char* pooltop = simpool; /* current allocation address */
-
-void *malloc(size_t size)
-{
-  char volatile *rv, *newtop;
-  do {
-    volatile char* after = pooltop + size + 16; /* allow for alignment */
-    if (after > simpool+poolsize) {
-      fprintf(stderr, " failed\n");
-      return 0;
-    }
-    rv = pooltop;
-    newtop = (char*)((unsigned long)after & ~0xfL); /* always align to 16 bytes */
-  } while (!__sync_bool_compare_and_swap(&pooltop, rv, newtop));
-      
-  return (void*)rv;
-}
-
-void free(void *ptr)
-{
-  /* we don't free stuff */
-}
-
-void *calloc(size_t nmemb, size_t size)
-{
-  return malloc(nmemb * size);
-}
-
-void *realloc(void *ptr, size_t size)
-{
-  return 0;
-}
-
-void *reallocarray(void *ptr, size_t nmemb, size_t size)
-{
-  return 0;
-}
-
-};
+#include "simpool.h"
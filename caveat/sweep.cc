@@ -0,0 +1,127 @@
+/*
+  Copyright (c) 2021 Peter Hsu.  All Rights Reserved.  See LICENCE file for details.
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "options.h"
+#include "uspike.h"
+#include "instructions.h"
+#include "sweep.h"
+
+static void range(const char* s, int* lo, int* hi)
+{
+  int n = sscanf(s, "%d:%d", lo, hi);
+  quitif(n < 1, "sweep range %s not lo:hi", s);
+  if (n == 1)
+    *hi = *lo;
+  quitif(*lo < 0 || *hi < *lo || *hi > 30, "bad sweep range %s", s);
+}
+
+sweep_t::sweep_t(const char* lines, const char* rows, int w)
+{
+  int line_lo, line_hi, rows_lo, rows_hi;
+  range(lines, &line_lo, &line_hi);
+  range(rows,  &rows_lo, &rows_hi);
+  quitif(w < 1, "sweep associativity must be positive");
+  max_ways = w;
+  nways = 0;
+  for (int a=1; a<max_ways; a*=2)
+    ways[nways++] = a;
+  ways[nways++] = max_ways;
+  nconfigs = (line_hi-line_lo+1) * (rows_hi-rows_lo+1);
+  config = new sweep_config_t[nconfigs];
+  sweep_config_t* c = config;
+  for (int lin=line_lo; lin<=line_hi; lin++)
+    for (int row=rows_lo; row<=rows_hi; row++, c++) {
+      c->lg_line = lin;
+      c->lg_rows = row;
+      long n = (1L<<row) * max_ways;
+      c->stack = new long[n];
+      for (long k=0; k<n; k++)
+	c->stack[k] = -1;
+      c->hist = new long[max_ways+1];
+      memset(c->hist, 0, (max_ways+1)*sizeof(long));
+    }
+  refs = 0;
+  npages = ((code.limit()-code.base()) >> SWEEP_PAGE) + 1;
+  pcmiss = new long**[npages];
+  memset(pcmiss, 0, npages*sizeof(long**));
+}
+
+long* sweep_t::missed(long pc)
+{
+  long off = pc - code.base();
+  long*** pg = &pcmiss[off >> SWEEP_PAGE];
+  if (!*pg) {
+    long n = 1L << (SWEEP_PAGE-1);
+    *pg = new long*[n];
+    memset(*pg, 0, n*sizeof(long*));
+  }
+  long** p = &(*pg)[(off & ((1L<<SWEEP_PAGE)-1)) >> 1];
+  if (!*p) {
+    *p = new long[nconfigs*nways];
+    memset(*p, 0, nconfigs*nways*sizeof(long));
+  }
+  return *p;
+}
+
+void sweep_t::reference(long a, long pc)
+{
+  refs++;
+  long* m = 0;
+  for (int k=0; k<nconfigs; k++) {
+    sweep_config_t* c = &config[k];
+    long line = a >> c->lg_line;
+    long* s = &c->stack[(line & ((1L<<c->lg_rows)-1)) * max_ways];
+    int d = 0;
+    while (d < max_ways && s[d] != line)
+      d++;
+    c->hist[d]++;
+    memmove(s+1, s, (d < max_ways ? d : max_ways-1)*sizeof(long));
+    s[0] = line;
+    if (d == 0)
+      continue;
+    if (!m)
+      m = missed(pc);
+    for (int j=0; j<nways && ways[j]<=d; j++)
+      m[k*nways+j]++;
+  }
+}
+
+void sweep_t::write(FILE* f)
+{
+  fprintf(f, "# %ld data references\n", refs);
+  fprintf(f, "# %6s %6s %6s %10s %12s %8s\n", "line", "rows", "ways", "bytes", "misses", "ratio");
+  for (int k=0; k<nconfigs; k++) {
+    sweep_config_t* c = &config[k];
+    long misses = refs;
+    for (int a=1; a<=max_ways; a++) {
+      misses -= c->hist[a-1];
+      fprintf(f, "  %6ld %6ld %6d %10ld %12ld %7.3f%%\n", 1L<<c->lg_line, 1L<<c->lg_rows, a,
+	      (long)a<<(c->lg_line+c->lg_rows), misses, refs ? 100.0*misses/refs : 0.0);
+    }
+  }
+  fprintf(f, "\n# Misses per PC, columns line/rows/ways\n#");
+  for (int k=0; k<nconfigs; k++)
+    for (int j=0; j<nways; j++)
+      fprintf(f, " %ld/%ld/%d", 1L<<config[k].lg_line, 1L<<config[k].lg_rows, ways[j]);
+  fprintf(f, "\n");
+  long n = 1L << (SWEEP_PAGE-1);
+  for (long g=0; g<npages; g++) {
+    if (!pcmiss[g])
+      continue;
+    for (long i=0; i<n; i++) {
+      long* m = pcmiss[g][i];
+      if (!m)
+	continue;
+      labelpc(code.base() + (g<<SWEEP_PAGE) + 2*i, f);
+      for (int k=0; k<nconfigs*nways; k++)
+	fprintf(f, " %ld", m[k]);
+      fprintf(f, "\n");
+    }
+  }
+}
@@ -0,0 +1,41 @@
+/*
+  Copyright (c) 2021 Peter Hsu.  All Rights Reserved.  See LICENCE file for details.
+*/
+
+#ifndef SWEEP_H
+#define SWEEP_H
+
+// Data cache size sweep in one run.  For every (line size, rows) pair
+// in the grid each set keeps an LRU stack of its most recent lines, up
+// to the largest associativity.  A reference found at depth d hits in
+// any cache of that geometry with more than d ways (Mattson stack
+// distance), so one histogram per pair gives miss counts for every
+// associativity at once.  Per-PC miss counts are kept for power-of-2
+// associativities only.
+
+#define SWEEP_PAGE  12		// log-base-2 text bytes per part of per-PC table
+
+struct sweep_config_t {
+  int lg_line;
+  int lg_rows;
+  long* stack;			// [rows][max_ways] line numbers, MRU first
+  long* hist;			// references by stack depth, [max_ways]=deeper
+};
+
+class sweep_t {
+  sweep_config_t* config;
+  int nconfigs;
+  int max_ways;
+  int ways[32];			// associativities reported per PC
+  int nways;
+  long refs;
+  long*** pcmiss;		// [text page][parcel][config][way], parts allocated on first miss
+  long npages;
+  long* missed(long pc);
+public:
+  sweep_t(const char* lines, const char* rows, int max_ways);
+  void reference(long a, long pc);
+  void write(FILE* f);
+};
+
+#endif
@@ -188,8 +188,12 @@ void assembly_paint(perf_t* p, struct assembly_t* assembly)
   WINDOW* win = assembly->win;
   long pc = assembly->base;
   wmove(win, 0, 0);
-  wprintw(win, "%16s %-5s %-4s %-5s %-5s", "Count", " CPI", "#ssi", "I$", "D$");
-  wprintw(win, "] %8s %8s %s\n", "PC", "Hex", "Assembly                q=quit");
+  wprintw(win, "%16s %-5s %-4s %-5s %-5s %-5s %-5s %-5s", "Count", " CPI", "#ssi", "I$", "D$", "Coh", "Br", "TLB");
+  wprintw(win, "] %8s %8s %-24s", "PC", "Hex", "Assembly");
+  interval_t last;
+  if (p->intervals(&last, 1) && last.cycles > 0)
+    wprintw(win, "IPC %4.2f  ", (double)last.instructions/last.cycles);
+  wprintw(win, "q=quit\n");
   if (pc != 0) {
     for (int y=1; y<getmaxy(win) && pc<code.limit(); y++) {
       wmove(win, y, 0);
@@ -210,6 +214,9 @@ void assembly_paint(perf_t* p, struct assembly_t* assembly)
       char* b = buf;
       b+=fmtpercent(b, p->imiss(pc), p->count(pc));
       b+=fmtpercent(b, p->dmiss(pc), p->count(pc));
+      b+=fmtpercent(b, p->cmiss(pc), p->count(pc));
+      b+=fmtpercent(b, p->bmiss(pc), p->count(pc));
+      b+=fmtpercent(b, p->tmiss(pc), p->count(pc));
       //      b+=sprintf(b , " %8ld", *icm);
       //      b+=sprintf(b , " %8ld", *dcm);
       b+=sprintf(b, " ");
@@ -244,6 +251,7 @@ void interactive()
   struct timeval t1, t2;
   for (;;) {
     gettimeofday(&t1, 0);
+    cur_core->snapshot();
     histo_compute(cur_core, &global, code.base(), code.limit());
     histo_compute(cur_core, &local, local.base, local.bound);
     histo_paint(&global, "Global", local.base, local.bound);
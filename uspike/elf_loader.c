@@ -35,10 +35,107 @@ static char* strtbl;
 static Elf64_Sym* symtbl;
 static long num_syms;
 
+/* Symbol indices built at load time */
+static long* byaddr;		/* sized symbols sorted by address */
+static long* up;		/* up[k] = last j<k whose symbol extends past start of k, or -1 */
+static long num_byaddr;
+static long* byfunc;		/* function entry addresses, ascending */
+static long num_byfunc;
+static long* byname;		/* open addressing hash of symbol index+1 */
+static long hashmask;
+static long* sorted;		/* named symbols sorted by name, then index */
+static long num_sorted;
+
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 #define CLAMP(a, lo, hi) MIN(MAX(a, lo), hi)
 
+static unsigned long hash_name(const char* name)
+{
+  unsigned long h = 0xcbf29ce484222325UL;
+  while (*name)
+    h = (h ^ (unsigned char)*name++) * 0x100000001b3UL;
+  return h;
+}
+
+static int cmp_long(const void* a, const void* b)
+{
+  long i = *(const long*)a;
+  long j = *(const long*)b;
+  return i < j ? -1 : i > j ? 1 : 0;
+}
+
+static int cmp_addr(const void* a, const void* b)
+{
+  long i = *(const long*)a;
+  long j = *(const long*)b;
+  if (symtbl[i].st_value != symtbl[j].st_value)
+    return symtbl[i].st_value < symtbl[j].st_value ? -1 : 1;
+  return i < j ? 1 : i > j ? -1 : 0; /* earlier symbol sorts last */
+}
+
+static int cmp_name(const void* a, const void* b)
+{
+  long i = *(const long*)a;
+  long j = *(const long*)b;
+  int c = strcmp(strtbl+symtbl[i].st_name, strtbl+symtbl[j].st_name);
+  if (c)
+    return c;
+  return i < j ? -1 : i > j ? 1 : 0;
+}
+
+/**
+ * Sorted address index and name hash table so labeling is
+ * O(log n) plus overlap depth, exact name lookup O(1) and
+ * prefix lookup O(log n).
+ */
+static void build_symbol_index()
+{
+  if (!symtbl || !strtbl)
+    return;
+  byaddr = (long*)malloc(num_syms*sizeof(long));
+  up = (long*)malloc(num_syms*sizeof(long));
+  num_byaddr = 0;
+  for (long i=0; i<num_syms; i++)
+    if (symtbl[i].st_size > 0)
+      byaddr[num_byaddr++] = i;
+  qsort(byaddr, num_byaddr, sizeof(long), cmp_addr);
+  for (long k=0; k<num_byaddr; k++) {
+    long start = symtbl[byaddr[k]].st_value;
+    long j = k-1;		/* skip symbols ending by start */
+    while (j >= 0 && (long)(symtbl[byaddr[j]].st_value + symtbl[byaddr[j]].st_size) <= start)
+      j = up[j];
+    up[k] = j;
+  }
+  byfunc = (long*)malloc(num_syms*sizeof(long));
+  num_byfunc = 0;
+  for (long i=0; i<num_syms; i++)
+    if (ELF64_ST_TYPE(symtbl[i].st_info) == STT_FUNC && symtbl[i].st_value != 0)
+      byfunc[num_byfunc++] = symtbl[i].st_value;
+  qsort(byfunc, num_byfunc, sizeof(long), cmp_long);
+  long size = 16;
+  while (size < 2*num_syms)
+    size *= 2;
+  byname = (long*)calloc(size, sizeof(long));
+  hashmask = size-1;
+  for (long i=0; i<num_syms; i++) {
+    const char* name = strtbl + symtbl[i].st_name;
+    if (*name == 0)
+      continue;
+    long h = hash_name(name) & hashmask;
+    while (byname[h] && strcmp(strtbl+symtbl[byname[h]-1].st_name, name) != 0)
+      h = (h+1) & hashmask;
+    if (!byname[h])		/* first definition wins */
+      byname[h] = i+1;
+  }
+  sorted = (long*)malloc(num_syms*sizeof(long));
+  num_sorted = 0;
+  for (long i=0; i<num_syms; i++)
+    if (strtbl[symtbl[i].st_name])
+      sorted[num_sorted++] = i;
+  qsort(sorted, num_sorted, sizeof(long), cmp_name);
+}
+
 /**
  * Get an annoymous memory segment using mmap() and load
  * from file at offset.  Return 0 if fail.
@@ -176,6 +273,7 @@ long load_elf_binary( const char* file_name, int include_data )
 	high_bound = header.sh_addr+header.sh_size;
     }
   }
+  build_symbol_index();
   //  insnSpace.base = low_bound;
   //  insnSpace.bound = high_bound;
   //  fprintf(stderr, "Text segment [0x%lx, 0x%lx)\n", low_bound, high_bound);
@@ -287,35 +385,85 @@ long initialize_stack(int argc, const char** argv, const char** envp)
 
 int elf_find_symbol(const char* name, long* begin, long* end)
 {
-  if (strtbl) {
-    for (int i=0; i<num_syms; i++) {
-      int n = strlen(name);
-      if (strncmp(strtbl+symtbl[i].st_name, name, n) == 0) {
-	*begin = symtbl[i].st_value;
-	if (end)
-	  *end = *begin + symtbl[i].st_size;
-	return 1;
+  if (!strtbl)
+    return 0;
+  long i = -1;
+  if (byname) {			/* exact match */
+    long h = hash_name(name) & hashmask;
+    for (; byname[h]; h=(h+1)&hashmask)
+      if (strcmp(strtbl+symtbl[byname[h]-1].st_name, name) == 0) {
+	i = byname[h]-1;
+	break;
       }
+  }
+  if (i < 0 && sorted) {	/* otherwise alphabetically first with name as prefix */
+    long lo=0, hi=num_sorted;
+    while (lo < hi) {
+      long mid = (lo+hi)/2;
+      if (strcmp(strtbl+symtbl[sorted[mid]].st_name, name) < 0)
+	lo = mid+1;
+      else
+	hi = mid;
     }
+    if (lo < num_sorted && strncmp(strtbl+symtbl[sorted[lo]].st_name, name, strlen(name)) == 0)
+      i = sorted[lo];
   }
-  return 0;
+  if (i < 0)
+    return 0;
+  *begin = symtbl[i].st_value;
+  if (end)
+    *end = *begin + symtbl[i].st_size;
+  return 1;
 }
 
 
+/*
+  Innermost symbol containing pc: the one starting closest below,
+  earliest in table if tied.  This used to be the first symbol in
+  table order containing pc, which for nested symbols (local labels
+  with sizes inside functions) named the outer one.  up[] skips
+  symbols ending before pc, so the walk visits only symbols that
+  overlap, at most the nesting depth.
+*/
 const char* elf_find_pc(long pc, long* offset)
 {
-  if (symtbl) {
-    for (int i=0; i<num_syms; i++) {
-      if (symtbl[i].st_value <= pc && pc < symtbl[i].st_value+symtbl[i].st_size) {
-	*offset = pc - symtbl[i].st_value;
-	return strtbl + symtbl[i].st_name;
-      }
+  long lo=0, hi=num_byaddr;	/* find first symbol starting after pc */
+  while (lo < hi) {
+    long mid = (lo+hi)/2;
+    if ((long)symtbl[byaddr[mid]].st_value <= pc)
+      lo = mid+1;
+    else
+      hi = mid;
+  }
+  for (long k=lo-1; k>=0; k=up[k]) {
+    Elf64_Sym* s = &symtbl[byaddr[k]];
+    if (pc < (long)(s->st_value + s->st_size)) {
+      *offset = pc - s->st_value;
+      return strtbl + s->st_name;
     }
   }
   return 0;
 }
 
 
+/*
+  Entry of the last function starting at or below pc, or 0 if none.
+  Function entries are instruction boundaries.
+*/
+long elf_func_below(long pc)
+{
+  long lo=0, hi=num_byfunc;	/* find first entry after pc */
+  while (lo < hi) {
+    long mid = (lo+hi)/2;
+    if (byfunc[mid] <= pc)
+      lo = mid+1;
+    else
+      hi = mid;
+  }
+  return lo > 0 ? byfunc[lo-1] : 0;
+}
+
+
 const char* reg_name[256] = {
   "zero","ra",  "sp",  "gp",  "tp",  "t0",  "t1",  "t2",
   "s0",  "s1",  "a0",  "a1",  "a2",  "a3",  "a4",  "a5",
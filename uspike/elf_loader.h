@@ -28,6 +28,7 @@ extern unsigned long low_bound, high_bound;
 long load_elf_binary(const char* file_name, int include_data);
 int elf_find_symbol(const char* name, long* begin, long* end);
 const char* elf_find_pc(long pc, long* offset);
+long elf_func_below(long pc);
 
 long initialize_stack(int argc, const char** argv, const char** envp);
 long emulate_brk(long addr);
@@ -12,7 +12,6 @@
 #include "hart.h"
 
 volatile hart_t* hart_t::cpu_list =0;
-volatile long hart_t::total_insns =0;
 volatile int hart_t::num_threads =0;
 
 hart_t* hart_t::find(int tid)
@@ -23,13 +22,12 @@ hart_t* hart_t::find(int tid)
   return 0;
 }
 
-void hart_t::incr_count(long n)
+long hart_t::total_count()
 {
-  _executed += n;
-  long oldtotal;
-  do {
-    oldtotal = total_insns;
-  } while (!__sync_bool_compare_and_swap(&total_insns, oldtotal, oldtotal+n));
+  long total = 0;
+  for (hart_t* p=list(); p; p=p->link)
+    total += p->_executed;
+  return total;
 }
 
 #ifdef DEBUG
@@ -142,11 +140,7 @@ hart_t::hart_t(mmu_t* m)
   do {
     link = list();
   } while (!__sync_bool_compare_and_swap(&cpu_list, link, this));
-  int old_n;			// atomically increment thread count
-  do {
-    old_n = num_threads;
-  } while (!__sync_bool_compare_and_swap(&num_threads, old_n, old_n+1));
-  _number = old_n;		// after loop in case of race
+  _number = __sync_fetch_and_add(&num_threads, 1);
 }
 
 hart_t::hart_t(hart_t* from, mmu_t* m) : hart_t(m)
@@ -31,8 +31,9 @@ class hart_t {
   int my_tid;				// my Linux thread number
   static volatile int num_threads;	// allocated
   int _number;				// index of this hart
-  static volatile long total_insns;	// instructions executed all threads
-  long _executed;			// executed this thread
+  char _pad1[64];			// keep counter in own cache line
+  long _executed;			// executed this thread, only it writes
+  char _pad2[64];
   volatile int clone_lock;	// 0=free, 1=locked
   friend int thread_interpreter(void* arg);
 public:
@@ -47,12 +48,16 @@ public:
   static int threads() { return num_threads; }
   int number() { return _number; }
   long executed() { return _executed; }
-  void incr_count(long n);
-  static long total_count() { return total_insns; }
+  void incr_count(long n) { _executed += n; }
+  static long total_count();		// sums all harts, not cheap
   long tid() { return my_tid; }
   void set_tid();
   static hart_t* find(int tid);
-  bool interpreter(long how_many);
+  // Subclasses with their own memory model override interpreter()
+  // to call interpret() with that model, see interpreter.h
+  virtual bool interpreter(long how_many);
+  template<class M> bool interpret(M* model, long how_many);
+  bool golden_insn(long opcode, long* pc);	// false at breakpoint
   
   class processor_t* spike() { return spike_cpu; }
   class mmu_t* mmu() { return caveat_mmu; }
@@ -3,6 +3,13 @@
 */
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "options.h"
 #include "uspike.h"
@@ -13,21 +20,260 @@
 
 insnSpace_t code;
 
+static const Opcode_t fused_ops[] = {
+  Op_lui_addi, Op_lui_addiw, Op_auipc_ld, Op_auipc_jalr,
+  Op_slt_bnez, Op_sltu_bnez, Op_slli_add,
+  Op_slt_bnez8, Op_sltu_bnez8, Op_slli_add8,
+};
+#define NUM_FUSED  (sizeof(fused_ops)/sizeof(Opcode_t))
+
+static volatile long fused_count[NUM_FUSED]; // as pages are decoded
+
 void insnSpace_t::loadelf(const char* elfname)
 {
   _entry = load_elf_binary(elfname, 1);
   _base=low_bound;
   _limit=high_bound;
-  int n = (_limit - _base) / 2;
-  predecoded=new Insn_t[n];
-  memset(predecoded, 0, n*sizeof(Insn_t));
-  // Predecode instruction code segment
-  long pc = _base;
-  while (pc < _limit) {
-    Insn_t i = code.set(pc, decoder(code.image(pc), pc));
-    pc += i.compressed() ? 2 : 4;
+  long n = (_limit - _base) / 2;
+  // Untouched parts of these arrays cost nothing
+  predecoded = (Insn_t*)mmap(0, n*sizeof(Insn_t), PROT_READ|PROT_WRITE,
+			     MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+  blocks = (bb_t**)mmap(0, n*sizeof(bb_t*), PROT_READ|PROT_WRITE,
+			MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+  dieif(predecoded==MAP_FAILED || blocks==MAP_FAILED, "Cannot allocate predecode arrays");
+  _pages = (_limit - _base + (1<<TEXT_PAGE_SHIFT) - 1) >> TEXT_PAGE_SHIFT;
+  pagestate = new char[_pages];
+  memset((char*)pagestate, PAGE_EMPTY, _pages);
+  startoff = new char[_pages];
+  memset((char*)startoff, -1, _pages);
+  startoff[0] = 0;		// found when each page is first decoded
+  char fname[PATH_MAX];
+  long hash = 0;
+  if (conf_pcache) {
+    hash = content_hash();
+    snprintf(fname, sizeof fname, "%s/%016lx.pdc", (const char*)conf_pcache, hash);
+    if (pcache_load(fname, hash))
+      return;
+  }
+  else if (conf_predecode == 0)
+    return;			// lazily on first touch
+  int threads = conf_predecode ? conf_predecode : 1;
+  pthread_t* tid = new pthread_t[threads];
+  for (int t=1; t<threads; t++)
+    dieif(pthread_create(&tid[t], 0, decode_thread, this), "Cannot create predecode thread");
+  decode_thread(this);
+  for (int t=1; t<threads; t++)
+    pthread_join(tid[t], 0);
+  delete[] tid;
+  if (conf_pcache)
+    pcache_save(fname, hash);
+}
+
+/*
+  Predecode cache file is one page of header followed by the predecoded
+  array, mapped copy-on-write so concurrent runs share page cache.  The
+  key covers everything the predecoded array depends on: text image and
+  addresses, ISA string, fusion, the opcode numbering and lengths, the
+  Insn_t layout, and PCACHE_FORMAT for what the key cannot see.
+*/
+
+#define PCACHE_MAGIC   0x3263647061766163L	/* "cavapdc2" */
+#define PCACHE_FORMAT  1	// bump when decoder, fusion or CAS rules change
+#define PCACHE_HEADER  4096
+
+struct pcache_header_t {
+  long magic;
+  long base;
+  long limit;
+  long hash;
+  long fused[NUM_FUSED];	// fused_count when saved
+};
+
+static long fnv1a(long h, const void* p, long n)
+{
+  const uint8_t* b = (const uint8_t*)p;
+  for (long k=0; k<n; k++)
+    h = (h ^ b[k]) * 0x100000001b3L;
+  return h;
+}
+
+long insnSpace_t::content_hash()
+{
+  long h = 0xcbf29ce484222325L;
+  // text eight bytes at a time, tail bytewise
+  long* w = (long*)_base;
+  long words = (_limit-_base) / 8;
+  for (long k=0; k<words; k++)
+    h = (h ^ w[k]) * 0x100000001b3L;
+  h = fnv1a(h, w+words, (_limit-_base) % 8);
+  h = fnv1a(h, &_base, sizeof _base);
+  h = fnv1a(h, &_limit, sizeof _limit);
+  h = fnv1a(h, (const char*)conf_isa, strlen(conf_isa));
+  h = fnv1a(h, conf_nofuse ? "-" : "+", 1);
+  long format[] = { PCACHE_FORMAT, sizeof(Insn_t), NUM_FUSED };
+  h = fnv1a(h, format, sizeof format);
+  h = fnv1a(h, op_len, Op_UNKNOWN+1);
+  for (int k=0; k<=Op_UNKNOWN; k++)
+    h = fnv1a(h, op_name[k], strlen(op_name[k])+1);
+  return h;
+}
+
+bool insnSpace_t::pcache_load(const char* fname, long hash)
+{
+  int fd = open(fname, O_RDONLY);
+  if (fd < 0)
+    return false;
+  long n = (_limit - _base) / 2;
+  pcache_header_t h;
+  struct stat st;
+  if (read(fd, &h, sizeof h) != sizeof h || fstat(fd, &st) != 0
+      || h.magic != PCACHE_MAGIC || h.base != _base || h.limit != _limit || h.hash != hash
+      || st.st_size < PCACHE_HEADER + n*(long)sizeof(Insn_t)) {
+    close(fd);
+    return false;
+  }
+  void* p = mmap(predecoded, n*sizeof(Insn_t), PROT_READ|PROT_WRITE,
+		 MAP_PRIVATE|MAP_FIXED, fd, PCACHE_HEADER);
+  close(fd);
+  dieif(p != predecoded, "Cannot map predecode cache %s", fname);
+  memset((char*)pagestate, PAGE_READY, _pages);
+  for (unsigned k=0; k<NUM_FUSED; k++)
+    fused_count[k] = h.fused[k];
+  return true;
+}
+
+void insnSpace_t::pcache_save(const char* fname, long hash)
+{
+  // write privately then rename, so readers never see partial file
+  char tmpname[PATH_MAX+32];
+  snprintf(tmpname, sizeof tmpname, "%s.%d", fname, getpid());
+  int fd = open(tmpname, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "Cannot create predecode cache %s\n", tmpname);
+    return;
+  }
+  static char header[PCACHE_HEADER];
+  pcache_header_t* h = (pcache_header_t*)header;
+  h->magic = PCACHE_MAGIC;
+  h->base = _base;
+  h->limit = _limit;
+  h->hash = hash;
+  for (unsigned k=0; k<NUM_FUSED; k++)
+    h->fused[k] = fused_count[k];
+  bool ok = write(fd, header, PCACHE_HEADER) == PCACHE_HEADER;
+  char* p = (char*)predecoded;
+  long left = (_limit - _base) / 2 * sizeof(Insn_t);
+  while (ok && left > 0) {
+    long n = write(fd, p, left);
+    ok = n > 0;
+    p += n;
+    left -= n;
+  }
+  ok = (close(fd) == 0) && ok;
+  if (!ok || rename(tmpname, fname) != 0) {
+    fprintf(stderr, "Cannot write predecode cache %s\n", fname);
+    unlink(tmpname);
+  }
+}
+
+// Each thread decodes one contiguous range of pages, so only the first
+// page of a range walks to find its start; the rest continue from the
+// page before.
+
+void* insnSpace_t::decode_thread(void* arg)
+{
+  static volatile long next_range;
+  insnSpace_t* s = (insnSpace_t*)arg;
+  long threads = conf_predecode ? conf_predecode : 1;
+  long per = (s->_pages + threads-1) / threads;
+  long r = __sync_fetch_and_add(&next_range, 1);
+  for (long k=r*per; k<(r+1)*per && k<s->_pages; k++)
+    if (s->pagestate[k] == PAGE_EMPTY)
+      s->decode_page(k);
+  return 0;
+}
+
+/*
+  Instruction length is in the low bits of each instruction, so where a
+  page's first instruction begins is found by walking forward from a
+  known boundary: the nearest function entry below the page, or the
+  start of the nearest earlier page already found, whichever is closer.
+  Racing threads compute the same value.
+*/
+
+long insnSpace_t::page_start(long k)
+{
+  if (startoff[k] >= 0)
+    return startoff[k];
+  long lo = _base + (k<<TEXT_PAGE_SHIFT);
+  long j = k;
+  while (startoff[--j] < 0)	// page 0 is always known
+    ;
+  long pc = _base + (j<<TEXT_PAGE_SHIFT) + startoff[j];
+  long f = elf_func_below(lo);
+  if (f > pc)
+    pc = f;
+  while (pc < lo)
+    pc += length(pc);
+  startoff[k] = pc - lo;
+  return startoff[k];
+}
+
+void insnSpace_t::decode_page(long k)
+{
+  if (!__sync_bool_compare_and_swap(&pagestate[k], PAGE_EMPTY, PAGE_BUSY)) {
+    while (pagestate[k] != PAGE_READY)
+      ;				// another thread is decoding it
+    return;
+  }
+  long lo = _base + (k<<TEXT_PAGE_SHIFT) + page_start(k);
+  long hi = _base + ((k+1)<<TEXT_PAGE_SHIFT);
+  if (hi > _limit)
+    hi = _limit;
+  long pc;
+  for (pc=lo; pc<hi; pc+=length(pc))
+    predecoded[index(pc)] = decoder(image(pc), pc);
+  if (k+1 < _pages)
+    startoff[k+1] = pc - hi;
+  // Patterns may continue into the next page, which is not decoded
+  substitute_cas(lo, hi);
+  if (!conf_nofuse)
+    substitute_fused(lo, hi);
+  __sync_synchronize();
+  pagestate[k] = PAGE_READY;
+}
+
+bb_t* insnSpace_t::translate(long pc)
+{
+  Insn_t buf[BB_MAX_INSNS];
+  long end = pc;
+  int n = 0;
+  do {
+    buf[n] = at(end);
+    end += op_len[buf[n].opcode()];
+  } while (!op_ends_block[buf[n++].opcode()] && n < BB_MAX_INSNS && valid(end));
+  bb_t* b = (bb_t*)new char[sizeof(bb_t) + n*sizeof(Insn_t)];
+  b->pc = pc;
+  b->end = end;
+  b->chain[0] = b->chain[1] = 0;
+  b->n = n;
+  b->count = 0;
+  b->native = 0;
+  memcpy(b->insn, buf, n*sizeof(Insn_t));
+  blocks[index(pc)] = b;	// racing threads build identical blocks
+  return b;
+}
+
+void insnSpace_t::flush_blocks()
+{
+  // Stale blocks are never freed, just made unreachable.  Zeroing pc
+  // defeats any chain pointer still leading to them.
+  for (long k=0; k<(_limit-_base)/2; k++) {
+    if (blocks[k]) {
+      blocks[k]->pc = 0;
+      blocks[k] = 0;
+    }
   }
-  substitute_cas(_base, _limit);
 }
 
 Insn_t reg1insn(Opcode_t code, int8_t rd, int8_t rs1)
@@ -80,6 +326,13 @@ Insn_t reg2imm(Opcode_t code, int8_t rd, int8_t rs1, int8_t rs2, int16_t imm)
   return i;
 }
 
+Insn_t fuseinsn(Opcode_t code, Insn_t first)
+{
+  Insn_t i = first;		// keep operands of first instruction
+  i.op_code = code;
+  return i;
+}
+
 Insn_t decoder(int b, long pc)
 {
   Insn_t i(Op_UNKNOWN);	       // recall all registers set to NOREG by default
@@ -92,10 +345,23 @@ Insn_t decoder(int b, long pc)
   return i;
 }
 
+static bool fused(long op)
+{
+  for (unsigned k=0; k<NUM_FUSED; k++)
+    if (op == fused_ops[k])
+      return true;
+  return false;
+}
+
 void redecode(long pc)
 {
-  if (code.valid(pc))
+  if (code.valid(pc)) {
     code.set(pc, decoder(code.image(pc), pc));
+    // breakpoint on second half of fused pair must split the pair
+    if (code.valid(pc-4) && fused(code.at(pc-4).opcode()))
+      code.set(pc-4, decoder(code.image(pc-4), pc-4));
+    code.flush_blocks();
+  }
 }
 
 #define LABEL_WIDTH  16
@@ -150,17 +416,20 @@ void disasm(long pc, const char* end, FILE* f)
 
 void substitute_cas(long lo, long hi)
 {
-  // look for compare-and-swap pattern
-  long possible=0, replaced=0;
-  for (long pc=lo; pc<hi; pc+=code.at(pc).compressed()?2:4) {
-    Insn_t i = code.at(pc);
+  // look for compare-and-swap pattern, called while page being decoded
+  // Lazily this runs on first touch of the page, so an unsupported
+  // pattern stops the run there; --predecode=N finds it at load.
+  long possible=0, replaced=0, lrpc=0;
+  for (long pc=lo; pc<hi && replaced==possible; pc+=code.length(pc)) {
+    Insn_t i = *code.descr(pc);
     if (!(i.opcode() == Op_lr_w || i.opcode() == Op_lr_d))
       continue;
     possible++;
-    Insn_t i2 = code.at(pc+4);
+    lrpc = pc;
+    Insn_t i2 = decoder(code.image(pc+4), pc+4);
     if (i2.opcode() != Op_bne && i2.opcode() != Op_c_bnez) continue;
     int len = 4 + (i2.opcode()==Op_c_bnez ? 2 : 4);
-    Insn_t i3 = code.at(pc+len);
+    Insn_t i3 = decoder(code.image(pc+len), pc+len);
     if (i3.opcode() != Op_sc_w && i3.opcode() != Op_sc_d) continue;
     // pattern found, check registers
     int load_reg = i.rd();
@@ -174,13 +443,73 @@ void substitute_cas(long lo, long hi)
     Opcode_t op;
     if (len == 8) op = (i.opcode() == Op_lr_w) ? Op_cas12_w : Op_cas12_d;
     else          op = (i.opcode() == Op_lr_w) ? Op_cas10_w : Op_cas10_d;
-    code.set(pc, reg3insn(op, flag_reg, addr_reg, test_reg, newv_reg));
+    *code.descr(pc) = reg3insn(op, flag_reg, addr_reg, test_reg, newv_reg);
     replaced++;
   }
   if (replaced != possible) {
-    fprintf(stderr, "%ld Load-Reserve found, %ld substitution failed\n", possible, possible-replaced);
+    fprintf(stderr, "Load-Reserve at %lx not compare-and-swap pattern, cannot substitute\n", lrpc);
     exit(-1);
   }
 }
 
+void substitute_fused(long lo, long hi)
+{
+  // Replace the first of a common adjacent pair with a superinstruction
+  // doing both.  The second instruction stays decoded in place because
+  // it may be a branch target.  First instruction is always 32-bit.
+  // Called while page being decoded, second may be on next page.
+  for (long pc=lo; pc<hi && code.valid(pc+4); pc+=code.length(pc)) {
+    Insn_t i = *code.descr(pc);
+    if (i.compressed() || i.rd() == 0)
+      continue;
+    Insn_t j = decoder(code.image(pc+4), pc+4);
+    Opcode_t op = Op_ZERO;
+    switch (i.opcode()) {
+    case Op_lui:
+      if (j.rs1() != i.rd() || j.rd() != i.rd()) break;
+      if      (j.opcode() == Op_addi)  op = Op_lui_addi;
+      else if (j.opcode() == Op_addiw) op = Op_lui_addiw;
+      break;
+    case Op_auipc:
+      if (j.rs1() != i.rd()) break;
+      if      (j.opcode() == Op_ld)    op = Op_auipc_ld;
+      else if (j.opcode() == Op_jalr)  op = Op_auipc_jalr;
+      break;
+    case Op_slt:
+    case Op_sltu:
+      if (j.rs1() != i.rd()) break;
+      if (j.opcode() == Op_c_bnez || j.opcode() == Op_c_beqz)
+        op = (i.opcode() == Op_slt) ? Op_slt_bnez : Op_sltu_bnez;
+      else if ((j.opcode() == Op_bne || j.opcode() == Op_beq) && j.rs2() == 0)
+        op = (i.opcode() == Op_slt) ? Op_slt_bnez8 : Op_sltu_bnez8;
+      break;
+    case Op_slli:
+      if (j.rs1() != i.rd() && j.rs2() != i.rd()) break;
+      if (j.opcode() == Op_c_add)
+        op = Op_slli_add;
+      else if (j.opcode() == Op_add && j.rd() != 0)
+        op = Op_slli_add8;
+      break;
+    }
+    if (op == Op_ZERO)
+      continue;
+    *code.descr(pc) = fuseinsn(op, i);
+    for (unsigned k=0; k<NUM_FUSED; k++)
+      if (op == fused_ops[k])
+        __sync_fetch_and_add(&fused_count[k], 1);
+  }
+}
+
+// Counts cover pages decoded so far, so call at exit.
+
+void fusion_report()
+{
+  if (conf_quiet || conf_nofuse)
+    return;
+  fprintf(stderr, "Fused pairs:");
+  for (unsigned k=0; k<NUM_FUSED; k++)
+    fprintf(stderr, " %s=%ld", op_name[fused_ops[k]], fused_count[k]);
+  fprintf(stderr, "\n");
+}
+
 #include "constants.h"
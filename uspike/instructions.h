@@ -6,6 +6,8 @@
 #include "opcodes.h"
 extern const char* op_name[];
 extern const char* reg_name[];
+extern const bool op_ends_block[];
+extern const char op_len[];
 
 // The bits[63:32] are a union with two different length immediates
 // For short immediates a 13-bit value is in [47:35] (right shfit by 3)
@@ -50,14 +52,57 @@ public:
   friend Insn_t reg0imm(Opcode_t code, int8_t rd, int32_t longimmed);
   friend Insn_t reg1imm(Opcode_t code, int8_t rd, int8_t rs1, int16_t imm);
   friend Insn_t reg2imm(Opcode_t code, int8_t rd, int8_t rs1, int8_t rs2, int16_t imm);
+  friend Insn_t fuseinsn(Opcode_t code, Insn_t first);
 };
 static_assert(sizeof(Insn_t) == 8);
 
+// Basic blocks are translated once from the predecoded array and cached
+// by starting pc.  A block ends at the first control transfer instruction.
+// The interpreter remembers the last successor of each block so most
+// block-to-block transitions do not look up the cache at all.
+
+#define BB_MAX_INSNS  64
+
+typedef long (*native_t)(long* xpr);	// compiled block returns next pc
+
+struct bb_t {
+  long pc;			// address of first instruction, 0 if flushed
+  long end;			// address after last instruction
+  bb_t* chain[2];		// last successor [0]=fall through, [1]=taken
+  long n;			// number of instructions
+  long count;			// times entered, until compiled
+  native_t native;		// compiled code for insn[0..prefix-1]
+  long prefix;
+  long retired;			// guest instructions retired by native code
+  Insn_t insn[0];		// predecoded instructions
+};
+
+// The text segment is predecoded a page at a time, either all at
+// load time (possibly by several threads) or lazily on first touch.
+
+#define TEXT_PAGE_SHIFT  12	// log-base-2 bytes
+#define PAGE_EMPTY  0
+#define PAGE_BUSY   1		// being decoded by some thread
+#define PAGE_READY  2
+
 class insnSpace_t {
   long _base;
   long _limit;
   long _entry;
   class Insn_t* predecoded;
+  bb_t** blocks;		// translation cache indexed like predecoded
+  volatile char* pagestate;	// PAGE_EMPTY/BUSY/READY
+  volatile char* startoff;	// offset of first instruction in page, -1 unknown
+  long _pages;
+  bb_t* translate(long pc);
+  void decode_page(long k);
+  long page_start(long k);
+  static void* decode_thread(void* arg);
+  long content_hash();
+  bool pcache_load(const char* fname, long hash);
+  void pcache_save(const char* fname, long hash);
+  long page(long pc) { return index(pc) >> (TEXT_PAGE_SHIFT-1); }
+  void ready(long pc) { long k=page(pc); if (pagestate[k] != PAGE_READY) decode_page(k); }
 public:  
   void loadelf(const char* elfname);
   long base() { return _base; }
@@ -66,10 +111,13 @@ public:
   
   bool valid(long pc) { return _base<=pc && pc<_limit; }
   long index(long pc) { checkif(valid(pc)); return (pc-_base)/2; }
-  Insn_t at(long pc) { return predecoded[index(pc)]; }
-  Insn_t* descr(long pc) { return &predecoded[index(pc)]; }
+  Insn_t at(long pc) { ready(pc); return predecoded[index(pc)]; }
+  Insn_t* descr(long pc) { return &predecoded[index(pc)]; } // does not decode
   uint32_t image(long pc) { checkif(valid(pc)); return *(uint32_t*)(pc); }
-  Insn_t set(long pc, Insn_t i) { predecoded[index(pc)] = i; return i; }
+  int length(long pc) { return (*(uint16_t*)pc & 0x3) == 0x3 ? 4 : 2; }
+  Insn_t set(long pc, Insn_t i) { ready(pc); predecoded[index(pc)] = i; return i; }
+  bb_t* block(long pc) { bb_t* b=blocks[index(pc)]; return b ? b : translate(pc); }
+  void flush_blocks();
 };
 
 /*
@@ -86,6 +134,9 @@ Insn_t decoder(int b, long pc);	// given bitpattern image of in struction
 extern insnSpace_t code;
 
 void substitute_cas(long lo, long hi);
+void substitute_fused(long lo, long hi);
+void fusion_report();
+void jit_compile(bb_t* bb);
 int slabelpc(char* buf, long pc);
 void labelpc(long pc, FILE* f =stderr);
 int sdisasm(char* buf, long pc);
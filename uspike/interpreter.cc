@@ -22,6 +22,10 @@ option<>     conf_vec("vec",		"vlen:128,elen:64,slen:128",	"Vector unit paramete
 option<long> conf_stat("stat",		100,				"Status every M instructions");
 option<bool> conf_ecall("ecall",	false, true,			"Show system calls");
 option<bool> conf_quiet("quiet",	false, true,			"No status report");
+option<bool> conf_nofuse("nofuse",	false, true,			"Do not fuse instruction pairs");
+option<long> conf_predecode("predecode",	0,			"Predecode text with N threads at load, 0=lazily per page");
+option<>     conf_pcache("pcache",	0, ".",				"Predecode cache directory");
+option<long> conf_jit("jit",		0,				"Compile blocks to native code after N executions, 0=never");
 
 
 struct syscall_map_t {
@@ -39,11 +43,12 @@ void status_report()
   if (conf_quiet)
     return;
   double realtime = elapse_time();
-  fprintf(stderr, "\r\33[2K%12ld insns %3.1fs %3.1f MIPS ", hart_t::total_count(), realtime, hart_t::total_count()/1e6/realtime);
+  long total = hart_t::total_count();
+  fprintf(stderr, "\r\33[2K%12ld insns %3.1fs %3.1f MIPS ", total, realtime, total/1e6/realtime);
   if (hart_t::threads() <= 16) {
     char separator = '(';
     for (hart_t* p=hart_t::list(); p; p=p->next()) {
-      fprintf(stderr, "%c%1ld%%", separator, 100*p->executed()/hart_t::total_count());
+      fprintf(stderr, "%c%1ld%%", separator, total ? 100*p->executed()/total : 0);
       separator = ',';
     }
     fprintf(stderr, ")");
@@ -87,54 +92,26 @@ template<class T> bool hart_t::cas(long pc)
 
 extern long (*golden[])(long pc, mmu_t& MMU, class processor_t* p);
 
-#define wrd(e)	xpr[i.rd()]=(e)
-#define r1	xpr[i.rs1()]
-#define r2	xpr[i.rs2()]
-#define imm	i.immed()
-#define MMU	(*mmu())
-#define wpc(npc)  pc=MMU.jump_model(npc, pc)
+bool hart_t::golden_insn(long opcode, long* pc)
+{
+  try {
+    *pc = golden[opcode](*pc, *mmu(), spike());
+  } catch (trap_breakpoint& e) {
+    return false;
+  }
+  return true;
+}
+
+template bool hart_t::cas<int32_t>(long pc);
+template bool hart_t::cas<int64_t>(long pc);
+
+#include "interpreter.h"
 
 bool hart_t::interpreter(long how_many)
 {
-  processor_t* p = spike();
-  long* xpr = reg_file();
-  long pc = read_pc();
-  long insns = 0;
-#ifdef DEBUG
-  long oldpc;
-#endif
-  do {
-#ifdef DEBUG
-    dieif(!code.valid(pc), "Invalid PC %lx, oldpc=%lx", pc, oldpc);
-    oldpc = pc;
-    debug.insert(executed()+insns+1, pc);
-#endif
-    mmu()->insn_model(pc);
-    Insn_t i = code.at(pc);
-    switch (i.opcode()) {
-#include "fastops.h"
-    default:
-      try {
-	pc = golden[i.opcode()](pc, *mmu(), spike());
-      } catch (trap_breakpoint& e) {
-	write_pc(pc);
-	incr_count(insns);
-	return true;
-      }
-    } // switch (i.opcode())
-    xpr[0] = 0;
-#ifdef DEBUG
-    i = code.at(oldpc);
-    int rn = i.rd()==NOREG ? i.rs2() : i.rd();
-    debug.addval(i.rd(), read_reg(rn));
-#endif
-  } while (++insns < how_many);
-  write_pc(pc);
-  incr_count(insns);
-  return false;
+  return interpret(mmu(), how_many);
 }
 
-#undef MMU
 long I_ZERO(long pc, mmu_t& MMU, hart_t* cpu)    { die("I_ZERO should never be dispatched!"); }
 long I_ILLEGAL(long pc, mmu_t& MMU, hart_t* cpu) { die("I_ILLEGAL at 0x%lx", pc); }
 long I_UNKNOWN(long pc, mmu_t& MMU, hart_t* cpu) { die("I_UNKNOWN at 0x%lx", pc); }
@@ -0,0 +1,192 @@
+/*
+  Copyright (c) 2021 Peter Hsu.  All Rights Reserved.  See LICENCE file for details.
+*/
+
+/*
+  The interpreter loop is a template over the memory model class so
+  that its hooks are called directly and inline into the dispatch loop.
+  Include after hart.h; a model class M provides (non-virtual is fine)
+  insn_model, branch_model, jump_model, load_model, store_model and
+  amo_model.
+*/
+
+#ifndef INTERPRETER_H
+#define INTERPRETER_H
+
+#include <type_traits>
+
+#define wrd(e)	xpr[i.rd()]=(e)
+#define r1	xpr[i.rs1()]
+#define r2	xpr[i.rs2()]
+#define imm	i.immed()
+#define MMU	fast
+#define wpc(npc)  pc=MMU.jump_model(npc, pc)
+#define br(cond)  MMU.branch_model(cond, pc)
+
+#ifdef DEBUG
+#define BEFORE_INSN							\
+  dieif(!code.valid(pc), "Invalid PC %lx, oldpc=%lx", pc, oldpc);	\
+  oldpc = pc;								\
+  debug.insert(executed()+insns+1, pc);
+#define AFTER_INSN							\
+  i = code.at(oldpc);							\
+  { int rn = i.rd()==NOREG ? i.rs2() : i.rd();				\
+    debug.addval(i.rd(), read_reg(rn)); }
+#else
+#define BEFORE_INSN
+#define AFTER_INSN
+#endif
+
+// Advance to successor block, following and updating the chain pointer
+#define NEXT_BLOCK							\
+  { int taken = (pc != bb->end);					\
+    bb_t* next = bb->chain[taken];					\
+    if (next == 0 || next->pc != pc) {					\
+      next = code.block(pc);						\
+      bb->chain[taken] = next;						\
+    }									\
+    bb = next; }
+
+// Run compiled prefix of block, unless stopping within it, otherwise
+// count toward compiling it.
+#define NATIVE_CODE							\
+  if (bb->native) {							\
+    if (end-ip == bb->n) {						\
+      pc = bb->native(xpr);						\
+      insns += bb->retired;						\
+      ip += bb->prefix;							\
+    }									\
+  }									\
+  else if (++bb->count == conf_jit)					\
+    jit_compile(bb);
+
+// Native code skips the per-instruction model hooks
+#define JIT_ALLOWED  (conf_jit && std::is_same<M, mmu_t>::value)
+
+#ifndef THREADED_DISPATCH
+
+template<class M> bool hart_t::interpret(M* model, long how_many)
+{
+  static_mmu_t<M> fast(model);
+  long* xpr = reg_file();
+  long pc = read_pc();
+  long insns = 0;
+  bool jit = JIT_ALLOWED;
+#ifdef DEBUG
+  long oldpc;
+#endif
+  bb_t* bb = code.block(pc);
+  while (1) {
+    Insn_t* ip = bb->insn;
+    Insn_t* end = ip + (bb->n < how_many-insns ? bb->n : how_many-insns);
+    if (jit) {
+      NATIVE_CODE;
+    }
+    for (; ip < end; ip++) {
+      BEFORE_INSN;
+      MMU.insn_model(pc);
+      Insn_t i = *ip;
+      switch (i.opcode()) {
+#include "fastops.h"
+      default:
+	if (!golden_insn(i.opcode(), &pc)) {
+	  write_pc(pc);
+	  incr_count(insns);
+	  return true;
+	}
+      } // switch (i.opcode())
+      xpr[0] = 0;
+      AFTER_INSN;
+      insns++;
+    }
+    if (insns >= how_many)
+      break;
+    NEXT_BLOCK;
+  }
+  write_pc(pc);
+  incr_count(insns);
+  return false;
+}
+
+#else
+
+// Direct threaded code: every handler in threadops.h ends with its own
+// copy of DISPATCH, so each opcode has a separate indirect jump site.
+
+#define DISPATCH							\
+  xpr[0] = 0;								\
+  AFTER_INSN;								\
+  insns++;								\
+  if (++ip >= end) goto block_end;					\
+  BEFORE_INSN;								\
+  MMU.insn_model(pc);						\
+  i = *ip;								\
+  goto *label[i.opcode()]
+
+template<class M> bool hart_t::interpret(M* model, long how_many)
+{
+  static void* const label[] = {
+#include "threadlabels.h"
+  };
+  static_mmu_t<M> fast(model);
+  long* xpr = reg_file();
+  long pc = read_pc();
+  long insns = 0;
+  Insn_t i;
+  Insn_t* ip;
+  Insn_t* end;
+  bool jit = JIT_ALLOWED;
+#ifdef DEBUG
+  long oldpc;
+#endif
+  bb_t* bb = code.block(pc);
+  while (1) {
+    ip = bb->insn;
+    end = ip + (bb->n < how_many-insns ? bb->n : how_many-insns);
+    if (jit) {
+      NATIVE_CODE;
+      if (ip >= end)
+	goto block_end;
+    }
+    BEFORE_INSN;
+    MMU.insn_model(pc);
+    i = *ip;
+    goto *label[i.opcode()];
+    
+#include "threadops.h"
+    
+  golden_op:
+    if (!golden_insn(i.opcode(), &pc)) {
+      write_pc(pc);
+      incr_count(insns);
+      return true;
+    }
+    DISPATCH;
+    
+  block_end:
+    if (insns >= how_many)
+      break;
+    NEXT_BLOCK;
+  }
+  write_pc(pc);
+  incr_count(insns);
+  return false;
+}
+
+#endif
+
+#undef wrd
+#undef r1
+#undef r2
+#undef imm
+#undef MMU
+#undef wpc
+#undef br
+#undef BEFORE_INSN
+#undef AFTER_INSN
+#undef NEXT_BLOCK
+#undef NATIVE_CODE
+#undef JIT_ALLOWED
+#undef DISPATCH
+
+#endif
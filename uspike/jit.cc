@@ -0,0 +1,410 @@
+/*
+  Copyright (c) 2021 Peter Hsu.  All Rights Reserved.  See LICENCE file for details.
+*/
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "options.h"
+#include "uspike.h"
+#include "instructions.h"
+
+/*
+  Translate hot basic blocks into x86-64 machine code.  Compiled code
+  has the signature  long f(long* xpr)  and returns the next pc.  Guest
+  registers are not cached in host registers: every instruction loads
+  its operands from and stores its result to the register file, which
+  therefore stays the canonical state.  Host registers used are
+  rdi=xpr, rax, rcx and rdx (all caller-saved).
+
+  A block is compiled up to its first instruction not in the subset
+  below.  The interpreter resumes at that instruction.
+*/
+
+#define JIT_POOL_SIZE  (1L<<28)
+#define JIT_MAX_BYTES  96		// per instruction, generous
+
+static uint8_t* pool;
+static volatile long pool_used;
+
+enum { RAX=0, RCX=1, RDX=2 };
+
+class emitter_t {
+  uint8_t* buf;
+  int n;
+public:
+  emitter_t(uint8_t* b) { buf=b; n=0; }
+  int size() { return n; }
+  void b(int x) { buf[n++] = x; }
+  void d(int32_t x) { memcpy(buf+n, &x, 4); n+=4; }
+  void q(int64_t x) { memcpy(buf+n, &x, 8); n+=8; }
+
+  void ld(int r, int rn) {	// r = xpr[rn]
+    if (rn == 0) { b(0x31); b(0xC0|r<<3|r); return; } // xor r32,r32
+    b(0x48); b(0x8B); b(0x80|r<<3|7); d(8*rn);
+  }
+  void st(int r, int rn) {	// xpr[rn] = r
+    if (rn == 0) return;
+    b(0x48); b(0x89); b(0x80|r<<3|7); d(8*rn);
+  }
+  void li(int r, long v) {
+    if (v == int32_t(v)) { b(0x48); b(0xC7); b(0xC0|r); d(v); }
+    else                 { b(0x48); b(0xB8|r); q(v); }
+  }
+  void alu(int opc) { b(0x48); b(opc); b(0xC8); } // opc rax,rcx
+  void sext32() { b(0x48); b(0x63); b(0xC0); }	  // movsxd rax,eax
+  void shift(int ext, bool word) { if (!word) b(0x48); b(0xD3); b(0xC0|ext<<3); } // by cl
+  void setcc(int cc) { alu(0x39); b(0x0F); b(0x90|cc); b(0xC0); b(0x0F); b(0xB6); b(0xC0); }
+  void mem(int rex, int opc0, int opc1, int r, long disp) { // op r,[rax+disp]
+    if (rex) b(rex);
+    if (opc0) b(opc0);
+    b(opc1); b(0x80|r<<3); d(disp);
+  }
+  void ret() { b(0xC3); }
+};
+
+/* Condition codes for setcc/cmovcc */
+#define CC_B   0x2
+#define CC_AE  0x3
+#define CC_E   0x4
+#define CC_NE  0x5
+#define CC_L   0xC
+#define CC_GE  0xD
+
+static void emit_load(emitter_t& e, long op, int rd, long disp)
+{
+  switch (op) {		// address in rax
+  case Op_lb:   e.mem(0x48, 0x0F, 0xBE, RAX, disp);  break;
+  case Op_lbu:  e.mem(0,    0x0F, 0xB6, RAX, disp);  break;
+  case Op_lh:   e.mem(0x48, 0x0F, 0xBF, RAX, disp);  break;
+  case Op_lhu:  e.mem(0,    0x0F, 0xB7, RAX, disp);  break;
+  case Op_c_lw:
+  case Op_c_lwsp:
+  case Op_lw:   e.mem(0x48, 0,    0x63, RAX, disp);  break;
+  case Op_lwu:  e.mem(0,    0,    0x8B, RAX, disp);  break;
+  default:      e.mem(0x48, 0,    0x8B, RAX, disp);  break;
+  }
+  e.st(RAX, rd);
+}
+
+static void emit_store(emitter_t& e, long op, long disp)
+{
+  switch (op) {		// address in rax, value in rcx
+  case Op_sb:   e.mem(0,    0,    0x88, RCX, disp);  break;
+  case Op_sh:   e.mem(0x66, 0,    0x89, RCX, disp);  break;
+  case Op_c_sw:
+  case Op_c_swsp:
+  case Op_sw:   e.mem(0,    0,    0x89, RCX, disp);  break;
+  default:      e.mem(0x48, 0,    0x89, RCX, disp);  break;
+  }
+}
+
+static void emit_branch(emitter_t& e, int cc, long taken, long fallthru)
+{
+  e.alu(0x39);			// cmp rax,rcx
+  e.li(RAX, fallthru);		// mov does not change flags
+  e.li(RDX, taken);
+  e.b(0x48); e.b(0x0F); e.b(0x40|cc); e.b(0xC2); // cmovcc rax,rdx
+  e.ret();
+}
+
+static void emit_jump(emitter_t& e, int rd, long link)
+{
+  // target in rax
+  if (rd != 0) {
+    e.li(RCX, link);
+    e.st(RCX, rd);
+  }
+  e.ret();
+}
+
+/* Emit one instruction.  Returns number of guest instructions it
+   retires, or 0 if not translatable.  *ends set for control transfer. */
+static int emit(emitter_t& e, Insn_t i, long pc, bool* ends)
+{
+  long op = i.opcode();
+  int rd = i.rd();
+  long imm = i.immed();
+  *ends = false;
+  switch (op) {
+  case Op_lui:
+  case Op_c_li:
+  case Op_c_lui:
+    e.li(RAX, imm);
+    e.st(RAX, rd);
+    return 1;
+  case Op_auipc:
+    e.li(RAX, pc+imm);
+    e.st(RAX, rd);
+    return 1;
+  case Op_lui_addi:
+  case Op_lui_addiw:
+    { long v = imm + code.at(pc+4).immed();
+      e.li(RAX, op==Op_lui_addiw ? long(int32_t(v)) : v);
+      e.st(RAX, rd);
+    }
+    return 2;
+  case Op_auipc_ld:
+    { Insn_t j = code.at(pc+4);
+      e.li(RAX, pc+imm);
+      e.st(RAX, rd);
+      e.li(RAX, pc+imm+j.immed());
+      emit_load(e, Op_ld, j.rd(), 0);
+    }
+    return 2;
+
+  case Op_c_addi4spn:
+  case Op_c_addi:
+  case Op_c_addi16sp:
+  case Op_addi:
+  case Op_c_addiw:
+  case Op_addiw:
+  case Op_c_andi:
+  case Op_andi:
+  case Op_ori:
+  case Op_xori:
+  case Op_slti:
+  case Op_sltiu:
+  case Op_c_slli:
+  case Op_slli:
+  case Op_c_srli:
+  case Op_srli:
+  case Op_c_srai:
+  case Op_srai:
+  case Op_slliw:
+  case Op_srliw:
+  case Op_sraiw:
+  case Op_slli_add:
+  case Op_slli_add8:
+    e.ld(RAX, i.rs1());
+    e.li(RCX, imm);
+    break;
+
+  case Op_c_add:
+  case Op_add:
+  case Op_c_addw:
+  case Op_addw:
+  case Op_c_subw:
+  case Op_sub:
+  case Op_subw:
+  case Op_and:
+  case Op_or:
+  case Op_xor:
+  case Op_slt:
+  case Op_sltu:
+  case Op_sll:
+  case Op_srl:
+  case Op_sra:
+  case Op_sllw:
+  case Op_srlw:
+  case Op_sraw:
+    e.ld(RAX, i.rs1());
+    e.ld(RCX, i.rs2());
+    break;
+  case Op_c_mv:
+    e.ld(RAX, i.rs2());
+    e.st(RAX, rd);
+    return 1;
+
+  case Op_c_lw:
+  case Op_c_ld:
+  case Op_c_lwsp:
+  case Op_c_ldsp:
+  case Op_lb:
+  case Op_lh:
+  case Op_lw:
+  case Op_ld:
+  case Op_lbu:
+  case Op_lhu:
+  case Op_lwu:
+    e.ld(RAX, i.rs1());
+    emit_load(e, op, rd, imm);
+    return 1;
+  case Op_c_sw:
+  case Op_c_sd:
+  case Op_c_swsp:
+  case Op_c_sdsp:
+  case Op_sb:
+  case Op_sh:
+  case Op_sw:
+  case Op_sd:
+    e.ld(RAX, i.rs1());
+    e.ld(RCX, i.rs2());
+    emit_store(e, op, imm);
+    return 1;
+
+  case Op_beq:
+  case Op_bne:
+  case Op_blt:
+  case Op_bge:
+  case Op_bltu:
+  case Op_bgeu:
+  case Op_c_beqz:
+  case Op_c_bnez:
+    { int cc;
+      switch (op) {
+      case Op_beq:  case Op_c_beqz:  cc = CC_E;   break;
+      case Op_bne:  case Op_c_bnez:  cc = CC_NE;  break;
+      case Op_blt:   cc = CC_L;   break;
+      case Op_bge:   cc = CC_GE;  break;
+      case Op_bltu:  cc = CC_B;   break;
+      default:       cc = CC_AE;  break;
+      }
+      e.ld(RAX, i.rs1());
+      e.ld(RCX, (op==Op_c_beqz || op==Op_c_bnez) ? 0 : i.rs2());
+      emit_branch(e, cc, pc+imm, pc+(i.compressed()?2:4));
+    }
+    *ends = true;
+    return 1;
+  case Op_slt_bnez:
+  case Op_sltu_bnez:
+  case Op_slt_bnez8:
+  case Op_sltu_bnez8:
+    { Insn_t j = code.at(pc+4);
+      bool nez = j.opcode()==Op_c_bnez || j.opcode()==Op_bne;
+      e.ld(RAX, i.rs1());
+      e.ld(RCX, i.rs2());
+      e.setcc(op==Op_slt_bnez || op==Op_slt_bnez8 ? CC_L : CC_B);
+      e.st(RAX, rd);
+      e.b(0x31); e.b(0xC9);	// xor ecx,ecx
+      emit_branch(e, nez ? CC_NE : CC_E, pc+4+j.immed(), pc+op_len[op]);
+    }
+    *ends = true;
+    return 2;
+
+  case Op_jal:
+  case Op_c_j:
+    e.li(RAX, pc+imm);
+    emit_jump(e, op==Op_jal ? rd : 0, pc+4);
+    *ends = true;
+    return 1;
+  case Op_jalr:
+  case Op_c_jr:
+  case Op_c_jalr:
+    e.ld(RAX, i.rs1());
+    if (op == Op_jalr) {
+      e.li(RCX, imm);
+      e.alu(0x01);
+      e.b(0x48); e.b(0x83); e.b(0xE0); e.b(0xFE); // and rax,~1
+    }
+    emit_jump(e, op==Op_c_jr ? 0 : rd, pc+(i.compressed()?2:4));
+    *ends = true;
+    return 1;
+  case Op_auipc_jalr:
+    { Insn_t j = code.at(pc+4);
+      e.li(RAX, pc+imm);
+      e.st(RAX, rd);
+      e.ld(RAX, j.rs1());
+      e.li(RCX, j.immed());
+      e.alu(0x01);
+      e.b(0x48); e.b(0x83); e.b(0xE0); e.b(0xFE);
+      emit_jump(e, j.rd(), pc+8);
+    }
+    *ends = true;
+    return 2;
+
+  default:
+    return 0;
+  }
+
+  // Operands in rax and rcx, compute into rax
+  int n = 1;
+  switch (op) {
+  case Op_c_addi4spn:
+  case Op_c_addi:
+  case Op_c_addi16sp:
+  case Op_addi:
+  case Op_c_add:
+  case Op_add:		e.alu(0x01);			break;
+  case Op_c_addiw:
+  case Op_addiw:
+  case Op_c_addw:
+  case Op_addw:		e.alu(0x01);  e.sext32();	break;
+  case Op_sub:		e.alu(0x29);			break;
+  case Op_c_subw:
+  case Op_subw:		e.alu(0x29);  e.sext32();	break;
+  case Op_c_andi:
+  case Op_andi:
+  case Op_and:		e.alu(0x21);			break;
+  case Op_ori:
+  case Op_or:		e.alu(0x09);			break;
+  case Op_xori:
+  case Op_xor:		e.alu(0x31);			break;
+  case Op_slti:
+  case Op_slt:		e.setcc(CC_L);			break;
+  case Op_sltiu:
+  case Op_sltu:		e.setcc(CC_B);			break;
+  case Op_c_slli:
+  case Op_slli:
+  case Op_sll:		e.shift(4, false);		break;
+  case Op_c_srli:
+  case Op_srli:
+  case Op_srl:		e.shift(5, false);		break;
+  case Op_c_srai:
+  case Op_srai:
+  case Op_sra:		e.shift(7, false);		break;
+  case Op_slliw:
+  case Op_sllw:		e.shift(4, true);  e.sext32();	break;
+  case Op_srliw:
+  case Op_srlw:		e.shift(5, true);  e.sext32();	break;
+  case Op_sraiw:
+  case Op_sraw:		e.shift(7, true);  e.sext32();	break;
+  case Op_slli_add:
+  case Op_slli_add8:
+    { Insn_t j = code.at(pc+4);
+      e.shift(4, false);
+      e.st(RAX, rd);
+      e.ld(RAX, j.rs1());
+      e.ld(RCX, j.rs2());
+      e.alu(0x01);
+      rd = j.rd();
+      n = 2;
+    }
+    break;
+  }
+  e.st(RAX, rd);
+  return n;
+}
+
+void jit_compile(bb_t* bb)
+{
+  if (pool == 0) {
+    static volatile int lock;
+    while (__sync_lock_test_and_set(&lock, 1))
+      ;
+    if (pool == 0) {
+      void* p = mmap(0, JIT_POOL_SIZE, PROT_READ|PROT_WRITE|PROT_EXEC,
+		     MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+      dieif(p == MAP_FAILED, "Cannot allocate JIT code pool");
+      pool = (uint8_t*)p;
+    }
+    __sync_lock_release(&lock);
+  }
+  uint8_t buf[(BB_MAX_INSNS+1)*JIT_MAX_BYTES];
+  emitter_t e(buf);
+  long pc = bb->pc;
+  long k, retired = 0;
+  bool ends = false;
+  for (k=0; k<bb->n && !ends; k++) {
+    int n = emit(e, bb->insn[k], pc, &ends);
+    if (n == 0)
+      break;
+    retired += n;
+    pc += op_len[bb->insn[k].opcode()];
+  }
+  if (k == 0)			// nothing translatable, never try again
+    return;
+  if (!ends) {
+    e.li(RAX, pc);
+    e.ret();
+  }
+  long offset = __sync_fetch_and_add(&pool_used, e.size());
+  if (offset+e.size() > JIT_POOL_SIZE)
+    return;			// pool exhausted, keep interpreting
+  memcpy(pool+offset, buf, e.size());
+  bb->prefix = k;
+  bb->retired = retired;
+  __sync_synchronize();
+  bb->native = (native_t)(pool+offset);
+}
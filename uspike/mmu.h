@@ -8,11 +8,13 @@ class mmu_t {
   virtual long load_model( long a, long pc) { return a; }
   virtual long store_model(long a, long pc) { return a; }
   virtual void amo_model(  long a, long pc) { }
+  template<class M> friend class static_mmu_t;
   
  public:
   mmu_t() { }
   virtual void insn_model(long pc) { }
   virtual long jump_model(long npc, long pc) { return npc; }
+  virtual bool branch_model(bool taken, long pc) { return taken; } // conditional
 
   uint8_t  load_uint8( long a, long pc) { return *(uint8_t* )load_model(a, pc); }
   uint16_t load_uint16(long a, long pc) { return *(uint16_t*)load_model(a, pc); }
@@ -59,7 +61,39 @@ class mmu_t {
   void yield_load_reservation() { }
   bool check_load_reservation(long a, long size) { return true; }
   void flush_icache() { }
-  void flush_tlb() { }
+  virtual void flush_tlb() { }
+};
+
+// Same accessors bound at compile time to model class M, so calls
+// to its hooks are not virtual and can be inlined.  Used by the
+// interpreter fast path; Spike semantics still go through mmu_t.
+template<class M> class static_mmu_t {
+  M* m;
+public:
+  static_mmu_t(M* model) { m = model; }
+  void insn_model(long pc) { m->M::insn_model(pc); }
+  long jump_model(long npc, long pc) { return m->M::jump_model(npc, pc); }
+  bool branch_model(bool taken, long pc) { return m->M::branch_model(taken, pc); }
+
+  uint8_t  load_uint8( long a, long pc) { return *(uint8_t* )m->M::load_model(a, pc); }
+  uint16_t load_uint16(long a, long pc) { return *(uint16_t*)m->M::load_model(a, pc); }
+  uint32_t load_uint32(long a, long pc) { return *(uint32_t*)m->M::load_model(a, pc); }
+  uint64_t load_uint64(long a, long pc) { return *(uint64_t*)m->M::load_model(a, pc); }
+
+  int8_t  load_int8( long a, long pc) { return *(int8_t* )m->M::load_model(a, pc); }
+  int16_t load_int16(long a, long pc) { return *(int16_t*)m->M::load_model(a, pc); }
+  int32_t load_int32(long a, long pc) { return *(int32_t*)m->M::load_model(a, pc); }
+  int64_t load_int64(long a, long pc) { return *(int64_t*)m->M::load_model(a, pc); }
+
+  void store_uint8( long a, long pc, uint8_t  v) { *(uint8_t* )m->M::store_model(a, pc)=v; }
+  void store_uint16(long a, long pc, uint16_t v) { *(uint16_t*)m->M::store_model(a, pc)=v; }
+  void store_uint32(long a, long pc, uint32_t v) { *(uint32_t*)m->M::store_model(a, pc)=v; }
+  void store_uint64(long a, long pc, uint64_t v) { *(uint64_t*)m->M::store_model(a, pc)=v; }
+  
+  void store_int8( long a, long pc, int8_t  v) { *(int8_t* )m->M::store_model(a, pc)=v; }
+  void store_int16(long a, long pc, int16_t v) { *(int16_t*)m->M::store_model(a, pc)=v; }
+  void store_int32(long a, long pc, int32_t v) { *(int32_t*)m->M::store_model(a, pc)=v; }
+  void store_int64(long a, long pc, int64_t v) { *(int64_t*)m->M::store_model(a, pc)=v; }
 };
 
 #define load_uint8( a)  load_uint8( a, pc)
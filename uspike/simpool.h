@@ -0,0 +1,344 @@
+/*
+  Copyright (c) 2021 Peter Hsu.  All Rights Reserved.  See LICENCE file for details.
+*/
+
+/*
+  Replacement malloc family for simulator programs, included once in
+  the file containing main().  Memory comes from a static pool so host
+  allocations stay out of the guest address range.
+
+  Blocks up to 64KB are power-of-two size classes with a 16-byte
+  header.  Free blocks are kept on per-class lists in one of several
+  arenas, each with its own spinlock.  Guest threads are created
+  without their own TLS, so the arena is chosen by hashing the stack
+  address instead.  Larger blocks are whole pages, exactly as many as
+  asked for; freed ones merge with free neighbours and are reused
+  first-fit from lists binned by size.
+*/
+
+#ifndef SIMPOOL_H
+#define SIMPOOL_H
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+
+extern "C" {
+
+#define poolsize  (1L<<30)	/* size of simulation memory pool */
+#define POOL_MIN_CLASS   5	/* 32 byte blocks */
+#define POOL_CLASSES    16	/* largest small class, 64KB */
+#define POOL_CHUNK      16	/* refill small classes 64KB at a time */
+#define POOL_ARENAS     64
+#define POOL_PAGE     4096	/* granularity of large blocks */
+
+static char simpool[poolsize] __attribute__((aligned(4096)));	/* base of memory pool */
+static volatile long pooltop;	/* bytes carved so far */
+
+struct pool_head_t {		/* precedes every user block */
+  long size;			/* of whole block in bytes, power of 2 if small */
+  long offset;			/* user block start - 16 - block start */
+};
+
+struct pool_arena_t {
+  volatile int lock;
+  char* freelist[POOL_CLASSES+1];
+} __attribute__((aligned(64)));
+
+static pool_arena_t arena[POOL_ARENAS];
+
+struct pool_large_t {		/* free large block */
+  pool_large_t* next;
+  pool_large_t* prev;
+  long size;
+};
+
+#define POOL_LARGE_BINS  20	/* by log-base-2 pages */
+
+static volatile int large_lock;
+static pool_large_t* large_bin[POOL_LARGE_BINS];
+static long large_at[poolsize/POOL_PAGE]; /* size at first and last page of free large block */
+
+static pool_arena_t* my_arena()
+{
+  unsigned long sp = (unsigned long)&sp;
+  return &arena[((sp >> 16) * 0x9E3779B97F4A7C15UL) >> 58 & (POOL_ARENAS-1)];
+}
+
+static void pool_lock(volatile int* l)
+{
+  while (__sync_lock_test_and_set(l, 1))
+    while (*l)
+      ;
+}
+
+static int size_class(long need)
+{
+  int c = POOL_MIN_CLASS;
+  while (c <= POOL_CLASSES && (1L<<c) < need)
+    c++;
+  return c;
+}
+
+static char* pool_top(long n)
+{
+  /* Carve n bytes from top of pool, or 0 if they do not fit */
+  long base;
+  do {
+    base = pooltop;
+    if (base + n > poolsize) {
+      fprintf(stderr, "simpool exhausted\n");
+      return 0;
+    }
+  } while (!__sync_bool_compare_and_swap(&pooltop, base, base+n));
+  return simpool + base;
+}
+
+static char* pool_carve(pool_arena_t* a, int c)
+{
+  /* Carve new blocks of class c from top of pool, return one of them */
+  long n = 1L << (POOL_CHUNK-c);
+  char* b = pool_top(n << c);
+  if (!b)
+    return 0;
+  for (long k=1; k<n; k++) {
+    char* f = b + (k << c);
+    *(char**)f = a->freelist[c];
+    a->freelist[c] = f;
+  }
+  return b;
+}
+
+static int large_bin_of(long size)
+{
+  int b = 63 - __builtin_clzl(size/POOL_PAGE);
+  return b < POOL_LARGE_BINS ? b : POOL_LARGE_BINS-1;
+}
+
+static long page_of(void* p) { return ((char*)p - simpool) / POOL_PAGE; }
+
+static void large_insert(pool_large_t* f, long size)
+{
+  pool_large_t** bin = &large_bin[large_bin_of(size)];
+  f->size = size;
+  f->prev = 0;
+  f->next = *bin;
+  if (f->next)
+    f->next->prev = f;
+  *bin = f;
+  large_at[page_of(f)] = large_at[page_of((char*)f+size-1)] = size;
+}
+
+static void large_unlink(pool_large_t* f)
+{
+  if (f->next)
+    f->next->prev = f->prev;
+  if (f->prev)
+    f->prev->next = f->next;
+  else
+    large_bin[large_bin_of(f->size)] = f->next;
+  large_at[page_of(f)] = large_at[page_of((char*)f+f->size-1)] = 0;
+}
+
+static char* large_alloc(long* psize)
+{
+  /* First fit from freed large blocks, splitting off the rest */
+  long size = *psize;
+  pool_lock(&large_lock);
+  pool_large_t* f = 0;
+  for (int b=large_bin_of(size); b<POOL_LARGE_BINS && !f; b++)
+    for (f=large_bin[b]; f && f->size<size; f=f->next)
+      ;
+  if (f) {
+    large_unlink(f);
+    if (f->size - size > (1L<<POOL_CLASSES))
+      large_insert((pool_large_t*)((char*)f + size), f->size - size);
+    else
+      size = f->size;
+  }
+  __sync_lock_release(&large_lock);
+  *psize = size;
+  return f ? (char*)f : pool_top(size);
+}
+
+static void large_free_block(char* b, long size)
+{
+  /* Merge with free neighbours, give back to pool top if highest */
+  pool_lock(&large_lock);
+  long p = page_of(b);
+  if (p > 0 && large_at[p-1]) {
+    pool_large_t* f = (pool_large_t*)(b - large_at[p-1]);
+    large_unlink(f);
+    size += f->size;
+    b = (char*)f;
+  }
+  long q = page_of(b+size);
+  if (b+size < simpool+poolsize && large_at[q]) {
+    pool_large_t* f = (pool_large_t*)(b+size);
+    large_unlink(f);
+    size += f->size;
+  }
+  long top = b+size - simpool;
+  if (!(top == pooltop && __sync_bool_compare_and_swap(&pooltop, top, top-size)))
+    large_insert((pool_large_t*)b, size);
+  __sync_lock_release(&large_lock);
+}
+
+static void* pool_alloc(size_t size, size_t align)
+{
+  if (size > poolsize || align > poolsize)
+    return 0;
+  long need = size + sizeof(pool_head_t) + (align > 16 ? align : 0);
+  char* b;
+  long bsize;
+  int c = size_class(need);
+  if (c <= POOL_CLASSES) {
+    pool_arena_t* a = my_arena();
+    pool_lock(&a->lock);
+    b = a->freelist[c];
+    if (b)
+      a->freelist[c] = *(char**)b;
+    else
+      b = pool_carve(a, c);
+    __sync_lock_release(&a->lock);
+    bsize = 1L << c;
+  }
+  else {
+    bsize = (need + POOL_PAGE-1) & ~(POOL_PAGE-1L);
+    b = large_alloc(&bsize);
+  }
+  if (!b)
+    return 0;
+  char* user = b + sizeof(pool_head_t);
+  if (align > 16)
+    user = (char*)(((long)user + align-1) & ~(align-1));
+  pool_head_t* h = (pool_head_t*)user - 1;
+  h->size = bsize;
+  h->offset = (char*)h - b;
+  return user;
+}
+
+static bool in_pool(void* ptr)
+{
+  return simpool <= (char*)ptr && (char*)ptr < simpool+poolsize;
+}
+
+static size_t pool_usable(void* ptr)
+{
+  pool_head_t* h = (pool_head_t*)ptr - 1;
+  return h->size - sizeof(pool_head_t) - h->offset;
+}
+
+void *malloc(size_t size)
+{
+  return pool_alloc(size, 16);
+}
+
+void free(void *ptr)
+{
+  if (!in_pool(ptr))		/* including 0 */
+    return;
+  pool_head_t* h = (pool_head_t*)ptr - 1;
+  char* b = (char*)h - h->offset;
+  if (h->size > (1L<<POOL_CLASSES)) {
+    large_free_block(b, h->size);
+    return;
+  }
+  int c = __builtin_ctzl(h->size);
+  pool_arena_t* a = my_arena();
+  pool_lock(&a->lock);
+  *(char**)b = a->freelist[c];
+  a->freelist[c] = b;
+  __sync_lock_release(&a->lock);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+  if (size && nmemb > (size_t)-1/size)
+    return 0;
+  void* p = malloc(nmemb * size);
+  if (p)
+    memset(p, 0, nmemb * size);	/* recycled blocks are dirty */
+  return p;
+}
+
+void *realloc(void *ptr, size_t size)
+{
+  if (!ptr)
+    return malloc(size);
+  if (size == 0) {
+    free(ptr);
+    return 0;
+  }
+  if (!in_pool(ptr)) {		/* cannot know its size */
+    fprintf(stderr, "simpool realloc of foreign pointer %p\n", ptr);
+    abort();
+  }
+  size_t old = pool_usable(ptr);
+  if (size <= old)
+    return ptr;
+  void* p = malloc(size);
+  if (p) {
+    memcpy(p, ptr, old);
+    free(ptr);
+  }
+  return p;
+}
+
+void *reallocarray(void *ptr, size_t nmemb, size_t size)
+{
+  if (size && nmemb > (size_t)-1/size) {
+    errno = ENOMEM;
+    return 0;
+  }
+  return realloc(ptr, nmemb * size);
+}
+
+static bool bad_align(size_t align)
+{
+  return align == 0 || (align & (align-1)) != 0;
+}
+
+void *memalign(size_t align, size_t size)
+{
+  if (bad_align(align)) {
+    errno = EINVAL;
+    return 0;
+  }
+  return pool_alloc(size, align);
+}
+
+void *aligned_alloc(size_t align, size_t size)
+{
+  if (bad_align(align)) {
+    errno = EINVAL;
+    return 0;
+  }
+  return pool_alloc(size, align);
+}
+
+int posix_memalign(void **memptr, size_t align, size_t size)
+{
+  if (bad_align(align) || align % sizeof(void*))
+    return EINVAL;
+  void* p = pool_alloc(size, align);
+  if (!p)
+    return ENOMEM;
+  *memptr = p;
+  return 0;
+}
+
+void *valloc(size_t size)
+{
+  return pool_alloc(size, 4096);
+}
+
+size_t malloc_usable_size(void *ptr)
+{
+  return in_pool(ptr) ? pool_usable(ptr) : 0;
+}
+
+};
+
+#endif
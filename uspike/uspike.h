@@ -32,6 +32,10 @@ extern option<>     conf_vec;
 extern option<long> conf_stat;
 extern option<bool> conf_ecall;
 extern option<bool> conf_quiet;
+extern option<bool> conf_nofuse;
+extern option<long> conf_jit;
+extern option<long> conf_predecode;
+extern option<>     conf_pcache;
 //extern option<long> conf_show;
 //extern option<>     conf_gdb;
 